@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# bench.sh - Run each driver over the default traces and the given
+#            extra traces, then print one table comparing them
+#
+# usage: bench.sh <driver>... [-- <trace>...]
+#
+# The first driver also runs libc malloc (-l). mdriver -R collects the
+# results in $CSV, bench.csv by default; latencies are the percentiles
+# of all requests of a trace, in cycles, from mdriver -L.
+#
+CSV=${CSV:-bench.csv}
+
+drivers=
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    drivers="$drivers $1"
+    shift
+done
+[ "$1" = "--" ] && shift
+if [ -z "$drivers" ]; then
+    echo "usage: bench.sh <driver>... [-- <trace>...]" >&2
+    exit 1
+fi
+
+rm -f "$CSV"
+libc=-l
+for d in $drivers; do
+    echo "Running $d" >&2
+    ./$d -v 0 -L $libc -R "$CSV" > /dev/null 2>&1
+    for t in "$@"; do
+        ./$d -v 0 -L $libc -R "$CSV" -f "$t" > /dev/null 2>&1
+    done
+    libc=
+done
+
+awk -F, '
+NR == 1 { next }
+{
+    n = split($2, path, "/")
+    t = path[n]
+    a = $1
+    sub(/^mdriver-/, "", a)
+    if (!(t in seen_t)) { seen_t[t] = 1; traces[++nt] = t }
+    if (!(a in seen_a)) { seen_a[a] = 1; allocs[++na] = a }
+    k = t SUBSEP a
+    valid[k] = $3; util[k] = $4; kops[k] = $7; p99[k] = $9; p999[k] = $10
+    if ($3 == 1) {
+        ops[a] += $5
+        secs[a] += $6
+        usum[a] += $4
+        un[a]++
+    } else {
+        bad[a]++
+    }
+}
+function show(x) { return (x == "") ? "-" : x }
+END {
+    fmt = "%-22s %-14s %6s %9s %9s %9s\n"
+    printf fmt, "trace", "allocator", "util", "Kops", "p99", "p99.9"
+    for (i = 1; i <= nt; i++) {
+        name = traces[i]
+        for (j = 1; j <= na; j++) {
+            k = traces[i] SUBSEP allocs[j]
+            if (!(k in valid))
+                continue
+            if (valid[k] != 1)
+                printf "%-22s %-14s %6s\n", name, allocs[j], "invalid"
+            else
+                printf(fmt, name, allocs[j],
+                       (allocs[j] == "libc") ? "-" : (util[k] "%"),
+                       kops[k], show(p99[k]), show(p999[k]))
+            name = ""
+        }
+    }
+    name = "all"
+    for (j = 1; j <= na; j++) {
+        a = allocs[j]
+        printf("%-22s %-14s %6s %9.0f", name, a,
+               (a == "libc" || !un[a]) ? "-" : sprintf("%.1f%%", usum[a] / un[a]),
+               (secs[a] > 0) ? ops[a] / 1e3 / secs[a] : 0)
+        if (bad[a])
+            printf "  (%d invalid)", bad[a]
+        printf "\n"
+        name = ""
+    }
+}' "$CSV"
@@ -102,14 +102,30 @@
 #define UTIL_WEIGHT .61
 
 /*
- * Alignment requirement in bytes (either 4 or 8)
+ * Alignment requirement in bytes (4, 8, or 16 to check an allocator
+ * built for 16-byte payloads; override with -DALIGNMENT=16)
  */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
 
 /*
  * Maximum heap size in bytes
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (100*(1<<20))  /* 100 MB */
+#endif
+
+/*
+ * Set MEM_MMAP to "1" to back the heap with anonymous memory committed
+ * in MEM_CHUNK pieces. mem_sbrk can then shrink the heap, and chunks
+ * above the break are handed back to the OS. MAX_HEAP must be a
+ * multiple of MEM_CHUNK.
+ */
+#ifndef MEM_MMAP
+#define MEM_MMAP   0
+#endif
+#define MEM_CHUNK  (1<<20)     /* 1 MB */
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
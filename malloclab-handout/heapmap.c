@@ -0,0 +1,172 @@
+/*
+ * heapmap.c - Summarize the heap snapshots that mdriver -H writes
+ *
+ * Each snapshot starts with a "# <trace> ..." line followed by the CSV
+ * records of mm_dump: heap,offset,size,alloc,class,listed. For every
+ * snapshot this prints the external fragmentation, a histogram of free
+ * bytes per size class, and the largest-free-block curve: the share of
+ * free bytes that a request of each power-of-two size could use.
+ *
+ * usage: heapmap [-t <trace>] <file>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAXLINE  1024
+#define MAXCLASS 64     /* Size classes tracked per snapshot */
+#define MAXLOG   48     /* Curve rows: request sizes 2^0 .. 2^(MAXLOG-1) */
+#define BARLEN   40     /* Width of the longest histogram bar */
+
+/* One snapshot being read */
+typedef struct {
+    char title[MAXLINE];
+    long blocks, free_blocks;
+    size_t alloc_bytes, free_bytes, largest;
+    long bad;                           /* Listed but allocated, or unlisted free */
+    long class_blocks[MAXCLASS];
+    size_t class_bytes[MAXCLASS];
+    size_t log_bytes[MAXLOG];           /* free bytes by floor(log2(size)) */
+} snap_t;
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: heapmap [-t <trace>] <file>\n");
+    fprintf(stderr, "\t-t <trace>  Only report snapshots whose title contains <trace>.\n");
+}
+
+static void bar(double frac)
+{
+    int n = (int)(frac * BARLEN + 0.5);
+
+    while (n-- > 0)
+        putchar('#');
+}
+
+/*
+ * report - Print the summary of one snapshot
+ */
+static void report(snap_t *s)
+{
+    int i, top;
+    size_t usable;
+
+    printf("%s\n", s->title);
+    printf("  %ld blocks, %zu bytes allocated, %zu bytes in %ld free blocks\n",
+           s->blocks, s->alloc_bytes, s->free_bytes, s->free_blocks);
+    if (s->bad)
+        printf("  %ld blocks disagree with the free lists\n", s->bad);
+    if (s->free_bytes == 0) {
+        printf("\n");
+        return;
+    }
+    printf("  largest free block %zu bytes, external fragmentation %.1f%%\n",
+           s->largest, 100.0 * (1.0 - (double)s->largest / s->free_bytes));
+
+    printf("  free bytes by class:\n");
+    for (i = 0; i < MAXCLASS; i++) {
+        if (s->class_blocks[i] == 0)
+            continue;
+        printf("  %5d %8ld %12zu %5.1f%% ", i, s->class_blocks[i],
+               s->class_bytes[i], 100.0 * s->class_bytes[i] / s->free_bytes);
+        bar((double)s->class_bytes[i] / s->free_bytes);
+        printf("\n");
+    }
+
+    printf("  free bytes usable by a request of:\n");
+    for (top = MAXLOG - 1; top > 0 && s->log_bytes[top] == 0; top--)
+        ;
+    usable = s->free_bytes;
+    for (i = 0; i <= top; i++) {
+        if (i >= 4) {                   /* No block is below 16 bytes */
+            printf("  %12zu %5.1f%% ", (size_t)1 << i,
+                   100.0 * usable / s->free_bytes);
+            bar((double)usable / s->free_bytes);
+            printf("\n");
+        }
+        usable -= s->log_bytes[i];      /* Blocks below 2^(i+1) bytes */
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    char line[MAXLINE];
+    char *filter = NULL;
+    FILE *fp;
+    snap_t *s = NULL;
+    int c, heap, alloc, class, listed, lg;
+    long offset;
+    size_t size;
+
+    while ((c = getopt(argc, argv, "t:h")) != EOF) {
+        switch (c) {
+        case 't':
+            filter = optarg;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        exit(1);
+    }
+    if ((fp = fopen(argv[optind], "r")) == NULL) {
+        perror(argv[optind]);
+        exit(1);
+    }
+
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#') {
+            if (strstr(line, " disagree ") != NULL)
+                continue;               /* mdriver's note; recounted from the records */
+            if (s != NULL) {
+                report(s);
+                free(s);
+                s = NULL;
+            }
+            if (filter == NULL || strstr(line, filter) != NULL) {
+                if ((s = calloc(1, sizeof(*s))) == NULL) {
+                    perror("calloc");
+                    exit(1);
+                }
+                snprintf(s->title, MAXLINE, "%s", line + 2);
+            }
+            continue;
+        }
+        if (s == NULL || sscanf(line, "%d,%ld,%zu,%d,%d,%d", &heap, &offset,
+                                &size, &alloc, &class, &listed) != 6)
+            continue;                   /* Column header or skipped snapshot */
+
+        s->blocks++;
+        s->bad += (alloc == listed);
+        if (alloc) {
+            s->alloc_bytes += size;
+            continue;
+        }
+        s->free_blocks++;
+        s->free_bytes += size;
+        if (size > s->largest)
+            s->largest = size;
+        if (class >= 0 && class < MAXCLASS) {
+            s->class_blocks[class]++;
+            s->class_bytes[class] += size;
+        }
+        for (lg = 0; lg < MAXLOG - 1 && (size >> (lg + 1)) != 0; lg++)
+            ;
+        s->log_bytes[lg] += size;
+    }
+    if (s != NULL) {
+        report(s);
+        free(s);
+    }
+    fclose(fp);
+    return 0;
+}
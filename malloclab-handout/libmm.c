@@ -0,0 +1,155 @@
+/*
+ * libmm.c - Make the segregated allocator the malloc of any program
+ *
+ * libmm.so links mm.c, built with LIBMM_FLAGS, over memlib's MEM_MMAP
+ * heap, which reserves LIBMM_HEAP bytes of address space and commits it
+ * as the heap grows. The wrappers below give the libc names to the mm_*
+ * functions and add what programs expect beyond these: malloc(0) returns
+ * a unique pointer, failures set errno, and pthread_atfork holds the heap
+ * locks across fork(). The heap is set up on the first call, which may
+ * come from the dynamic loader before any constructor has run.
+ *
+ * usage: LD_PRELOAD=./libmm.so <command>
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+/* The rest of libmm.so is built with -fvisibility=hidden, so that the
+ * mm_* and mem_* symbols cannot interpose on a program's own */
+#define EXPORT __attribute__((visibility("default")))
+
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+static volatile int heap_ready;
+
+static void heap_init(void)
+{
+    mem_init();
+    if (mm_init() < 0) {
+        static const char msg[] = "libmm: mm_init failed\n";
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        _exit(127);
+    }
+    heap_ready = 1;
+}
+
+#define READY() do { if (!heap_ready) pthread_once(&heap_once, heap_init); } while (0)
+
+/* Registered from a constructor, not heap_init, as pthread_atfork may
+ * itself call malloc */
+__attribute__((constructor))
+static void libmm_atfork(void)
+{
+    READY();
+    pthread_atfork(mm_fork_prepare, mm_fork_release, mm_fork_release);
+}
+
+static void *nomem(void *p)
+{
+    if (p == NULL)
+        errno = ENOMEM;
+    return p;
+}
+
+static int pow2(size_t x)
+{
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    READY();
+    return nomem(mm_malloc(size ? size : 1));
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    mm_free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    READY();
+    if (nmemb == 0 || size == 0)
+        nmemb = size = 1;
+    return nomem(mm_calloc(nmemb, size));
+}
+
+/* realloc(ptr, 0) frees ptr and returns NULL, as glibc does */
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    READY();
+    if (ptr == NULL)
+        return malloc(size);
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+    return nomem(mm_realloc(ptr, size));
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (!pow2(alignment) || alignment % sizeof(void *) != 0)
+        return EINVAL;
+    READY();
+    if ((p = mm_memalign(alignment, size ? size : 1)) == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+/* glibc rounds a bad alignment up to a power of two; so does this */
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    size_t a = sizeof(void *);
+
+    while (a < alignment && a != 0)
+        a <<= 1;
+    if (a == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    READY();
+    return nomem(mm_memalign(a, size ? size : 1));
+}
+
+/* C17 drops the rule that size be a multiple of alignment */
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (!pow2(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign(alignment, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (size > (size_t)-1 - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    return mm_usable_size(ptr);
+}
@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -18,12 +19,25 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
 #include "config.h"
+#include "trace.h"
+
+/* Optional in mm.c: only the -P and -C comparisons need them */
+#pragma weak mm_set_policy
+#pragma weak mm_set_coalesce
+#pragma weak mm_dump
+#pragma weak mm_thread_safe
+#pragma weak mm_malloc_batch
+#pragma weak mm_free_batch
 
 /**********************
  * Constants and macros
@@ -33,6 +47,18 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define REPLAY_RUNS    3 /* -T keeps the fastest of this many runs */
+#define DRAIN_EVERY   32 /* -T threads check for handed-over frees this often */
+
+/*
+ * Latency histograms (-L) are log-linear in the style of HDR histograms:
+ * each power of two of cycles is split into HIST_SUB buckets, so a
+ * bucket is within 1/HIST_SUB of the values it holds.
+ */
+#define HIST_SUB_BITS  4
+#define HIST_SUB       (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS   ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+#define WORST_NUM      5 /* slowest requests reported per trace */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
@@ -54,21 +80,16 @@
  * Remember that index (-1) is the null pointer.
  */
 
-/* Records the extent of each block's payload */
+/* Records the extent of each block's payload, as a node of a treap */
 typedef struct range_t {
-    char *lo;              /* low payload address */
+    char *lo;              /* low payload address, the key */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* ranges below lo... */
+    struct range_t *right; /* ... and above hi */
+    unsigned int prio;     /* no lower than the prio of either child */
     int index;             /* same index as free; for debugging */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
-    int index;                        /* index for free() to use later */
-    size_t size;                      /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     char filename[MAXLINE];
@@ -77,9 +98,15 @@ typedef struct {
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
     traceop_t *ops;      /* array of requests */
+    int *lines;          /* line of each request in a text trace, or NULL */
+    void *map;           /* mapping of a binary trace holding ops, or NULL */
+    size_t map_len;
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
     int *block_rand_base;/* index into random_data, if debug is on */
+    void **batch;        /* blocks of the batch in progress, or NULL... */
+    int batch_base;      /* ... which covers requests batch_base to */
+    int batch_end;       /* batch_end-1 */
 } trace_t;
 
 /*
@@ -92,6 +119,44 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* The entry points of a malloc package, for the multithreaded replay */
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+} alloc_t;
+
+/* Blocks that other threads handed to one replay thread to free */
+typedef struct {
+    pthread_mutex_t lock;
+    void **items;
+    int n;
+} freeq_t;
+
+/* One thread's share of a trace in the multithreaded replay */
+typedef struct {
+    const alloc_t *fns;
+    traceop_t *ops;      /* requests on the ids this thread owns */
+    int num_ops;
+    char **blocks;       /* this thread's ptrs, indexed like trace->blocks */
+    freeq_t *inq;        /* blocks to free for other threads, or NULL... */
+    freeq_t *outq;       /* ... and the queue this thread's frees go to */
+    double secs;         /* time to issue ops */
+} replay_t;
+
+/* Latency of each request of a trace, in cycles, by request type */
+typedef struct {
+    unsigned long count[3];
+    unsigned long hist[3][HIST_BUCKETS];
+    unsigned long max[3];
+    struct {
+        unsigned long cycles;
+        int line;        /* of the request in the trace file */
+        int type;
+    } worst[WORST_NUM];  /* slowest first */
+} lat_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -137,6 +202,18 @@ int onetime_flag = 0;
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* Traces checked for correctness at once, each in its own process (-j) */
+static int check_jobs = 1;
+
+/* Heap snapshots at each trace's peak heap size go here (set by -H) */
+static FILE *heap_dump_fp = NULL;
+
+/* Request latencies, one lat_t per trace (set by -L) */
+static lat_t *latency = NULL;
+
+/* CSV rows of the results of each trace are appended here (set by -R) */
+static FILE *results_fp = NULL;
+
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -148,15 +225,33 @@ static char *default_tracefiles[] = {
 
 char autoresult[MAXLINE]; /* autoresult string */
 
+/* Names of the placement policies compared by -P, indexed by MM_xxx */
+static const char *policy_names[MM_POLICY_NUM] = {
+    "first fit", "best fit", "exact fit", "address-ordered fit"
+};
+
+/* Names of the coalescing modes compared by -C, indexed by MM_xxx */
+static const char *coalesce_names[MM_COALESCE_NUM] = {
+    "eager coalescing", "deferred coalescing"
+};
+
+/* The packages that -T replays */
+static const alloc_t mm_fns = { "mm", mm_malloc, mm_free, mm_realloc };
+static const alloc_t libc_fns = { "libc", malloc, free, realloc };
+
+/* Start, ops issued and frees drained points of a replay run */
+static pthread_barrier_t replay_barrier;
+
 /*********************
  * Function prototypes
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size,
                      const trace_t *trace, int opnum, int index);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static void check_ranges(const trace_t *trace, int opnum, const range_t *r);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
@@ -168,6 +263,10 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
+static int op_line(const trace_t *trace, int opnum);
+static int batch_len(const trace_t *trace, int opnum);
+static char *batch_alloc(trace_t *trace, int opnum);
+static void batch_free(trace_t *trace, int opnum, char *p);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace);
@@ -177,10 +276,19 @@ static void eval_libc_speed(void *ptr);
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
+static void dump_mm_heap(trace_t *trace, int tracenum, int num_ops);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, lat_t *lat);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printlatency(int n, stats_t *stats, lat_t *lat);
+static void writeresults(const char *name, int n, stats_t *stats, lat_t *lat);
+static void run_modes(int (*set_mode)(int), const char **names, int num_modes,
+                      int num_tracefiles, char **tracefiles,
+                      range_t *ranges, speed_t *speed_params);
+static void run_replay(int max_threads, const alloc_t *fns,
+                       int num_tracefiles, trace_t **traces);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -198,6 +306,100 @@ static void timeout_handler(int sig __attribute__((unused))) {
     longjmp(timeout_jmpbuf, 1);
 }
 
+/* The result of a trace checked by check_parallel, or errors < 0 if its
+   process died before it finished */
+typedef struct {
+    int valid;
+    int errors;
+} check_t;
+
+/* The processes of check_parallel, so that a timeout can kill them */
+static pid_t *check_pids = NULL;
+static int check_started = 0;
+
+/*
+ * check_parallel - Check the traces for correctness in up to check_jobs
+ *     processes at once, each with its own heap, and set the valid field
+ *     of their stats. Nothing is timed while they run.
+ */
+static void check_parallel(int num_tracefiles, const char *tracedir,
+                           char **tracefiles, stats_t *mm_stats)
+{
+    check_t *results;
+    range_t *ranges = NULL;
+    trace_t *trace;
+    int running = 0, status, i;
+    pid_t pid;
+
+    results = mmap(NULL, num_tracefiles * sizeof(check_t),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED)
+        unix_error("mmap failed in check_parallel");
+    if ((check_pids = (pid_t *)calloc(num_tracefiles, sizeof(pid_t))) == NULL)
+        unix_error("check_pids calloc in check_parallel failed");
+    fflush(NULL);               /* so that no child writes the same output */
+
+    for (check_started = 0; check_started < num_tracefiles || running > 0; ) {
+        if (check_started < num_tracefiles && running < check_jobs) {
+            i = check_started;
+            results[i].errors = -1;
+            if ((pid = fork()) < 0)
+                unix_error("fork failed in check_parallel");
+            if (pid == 0) {
+                mem_init();
+                trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
+                errors = 0;
+                results[i].valid = eval_mm_valid(trace, &ranges);
+                results[i].errors = errors;
+                _exit(0);
+            }
+            check_pids[check_started++] = pid;
+            running++;
+            continue;
+        }
+
+        if ((pid = wait(&status)) < 0)
+            unix_error("wait failed in check_parallel");
+        for (i = 0; i < check_started && check_pids[i] != pid; i++)
+            ;
+        if (i == check_started)
+            continue;
+        check_pids[i] = 0;
+        running--;
+        if (results[i].errors < 0) {
+            printf("ERROR [trace %s%s]: checking process %s %d\n",
+                   tracedir, tracefiles[i],
+                   WIFSIGNALED(status) ? "killed by signal" : "exited with",
+                   WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+            mm_stats[i].valid = 0;
+            errors++;
+        } else {
+            mm_stats[i].valid = results[i].valid;
+            errors += results[i].errors;
+        }
+    }
+
+    free(check_pids);
+    check_pids = NULL;
+    munmap(results, num_tracefiles * sizeof(check_t));
+}
+
+/* kill_checks - Stop the processes of check_parallel after a timeout */
+static void kill_checks(void)
+{
+    int i;
+
+    if (check_pids == NULL)
+        return;
+    for (i = 0; i < check_started; i++)
+        if (check_pids[i] != 0) {
+            kill(check_pids[i], SIGKILL);
+            waitpid(check_pids[i], NULL, 0);
+        }
+    free(check_pids);
+    check_pids = NULL;
+}
+
 /* Run the tests; return the number of tests run (may be less than
    num_tracefiles, if there's a timeout) */
 static void run_tests(int num_tracefiles, const char *tracedir,
@@ -205,6 +407,18 @@ static void run_tests(int num_tracefiles, const char *tracedir,
                       stats_t *mm_stats, range_t *ranges, speed_t *speed_params) {
     volatile int i;
     volatile int timed_out = 0;
+    volatile int checked = 0;
+
+    /* Optionally check all of the traces first, in parallel */
+    if (check_jobs > 1 && !onetime_flag) {
+        if (setjmp(timeout_jmpbuf) == 0)
+            check_parallel(num_tracefiles, tracedir, tracefiles, mm_stats);
+        else {
+            kill_checks();
+            timed_out = 1;
+        }
+        checked = 1;
+    }
 
     for (i=0; i < num_tracefiles; i++) {
         /* initialize simulated memory system in memlib.c *
@@ -222,7 +436,7 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         mm_stats[i].ops = trace->num_ops;
         if(timed_out) {
             mm_stats[i].valid = 0;
-        } else {
+        } else if (!checked) {
             if (verbose > 1)
                 printf("Checking mm_malloc for correctness, ");
             mm_stats[i].valid = eval_mm_valid(trace, &ranges);
@@ -241,6 +455,8 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+            if (latency != NULL)
+                eval_mm_latency(trace, &latency[i]);
         }
 
         free_trace(trace);
@@ -250,6 +466,281 @@ static void run_tests(int num_tracefiles, const char *tracedir,
     }
 }
 
+/*
+ * run_modes - Run the tests once for each mode that set_mode accepts,
+ *     printing the results of each under its name
+ */
+static void run_modes(int (*set_mode)(int), const char **names, int num_modes,
+                      int num_tracefiles, char **tracefiles,
+                      range_t *ranges, speed_t *speed_params)
+{
+    stats_t *mm_stats;
+    int i;
+
+    for (i = 0; i < num_modes; i++) {
+        if (set_mode(i) < 0)
+            continue;
+        mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+        if (mm_stats == NULL)
+            unix_error("mm_stats calloc in run_modes failed");
+        run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
+                  ranges, speed_params);
+        printf("\nResults for mm malloc, %s:\n", names[i]);
+        printresults(num_tracefiles, mm_stats);
+        if (latency != NULL)
+            printlatency(num_tracefiles, mm_stats, latency);
+        free(mm_stats);
+    }
+    set_mode(0);                /* Leave mm.c in its first mode */
+}
+
+/*
+ * replay_drain - Free the blocks that other threads handed to r
+ */
+static void replay_drain(replay_t *r)
+{
+    freeq_t *q = r->inq;
+    int i;
+
+    pthread_mutex_lock(&q->lock);
+    for (i = 0; i < q->n; i++)
+        r->fns->free(q->items[i]);
+    q->n = 0;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * replay_thread - Issue one thread's share of a trace. With an outq the
+ *     frees are handed to the next thread instead of done here.
+ */
+static void *replay_thread(void *arg)
+{
+    replay_t *r = (replay_t *)arg;
+    freeq_t *q = r->outq;
+    traceop_t *op;
+    struct timespec start, end;
+    char *p;
+    int i;
+
+    pthread_barrier_wait(&replay_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < r->num_ops; i++) {
+        op = &r->ops[i];
+        if (r->inq != NULL && i % DRAIN_EVERY == 0
+            && __atomic_load_n(&r->inq->n, __ATOMIC_RELAXED) != 0)
+            replay_drain(r);
+
+        switch (op->type) {
+        case ALLOC:
+        case ALLOC_BATCH:
+            if ((p = r->fns->malloc(op->size)) == NULL)
+                app_error("%s malloc failed in replay_thread\n", r->fns->name);
+            r->blocks[op->index] = p;
+            break;
+
+        case REALLOC:
+            p = r->fns->realloc(r->blocks[op->index], op->size);
+            if (p == NULL && op->size != 0)
+                app_error("%s realloc failed in replay_thread\n", r->fns->name);
+            r->blocks[op->index] = p;
+            break;
+
+        case FREE:
+        case FREE_BATCH:
+            if (op->index < 0) {
+                r->fns->free(NULL);
+                break;
+            }
+            p = r->blocks[op->index];
+            r->blocks[op->index] = NULL;
+            if (q == NULL) {
+                r->fns->free(p);
+            } else {
+                pthread_mutex_lock(&q->lock);
+                q->items[q->n++] = p;
+                pthread_mutex_unlock(&q->lock);
+            }
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    r->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    pthread_barrier_wait(&replay_barrier);      /* Nothing more is handed over */
+    if (r->inq != NULL)
+        replay_drain(r);
+    pthread_barrier_wait(&replay_barrier);
+    return NULL;
+}
+
+/*
+ * replay_trace - Replay a trace on nthreads threads, each owning the ids
+ *     that are equal to it modulo nthreads, REPLAY_RUNS times. Returns the
+ *     wall time of the fastest run and each thread's time and op count in
+ *     it. With remote set, blocks are freed by the thread after their owner.
+ */
+static double replay_trace(trace_t *trace, int nthreads, int remote,
+                           const alloc_t *fns, double *thread_secs,
+                           int *thread_ops)
+{
+    replay_t *rs;
+    freeq_t *qs;
+    pthread_t *tids;
+    struct timespec start, end;
+    double wall, best = DBL_MAX;
+    int i, t, run, num_frees = 0;
+
+    rs = (replay_t *)calloc(nthreads, sizeof(replay_t));
+    qs = (freeq_t *)calloc(nthreads, sizeof(freeq_t));
+    tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    if (rs == NULL || qs == NULL || tids == NULL)
+        unix_error("calloc in replay_trace failed");
+
+    /* Split the requests by id; free(NULL) goes to thread 0 */
+    for (t = 0; t < nthreads; t++) {
+        rs[t].fns = fns;
+        rs[t].ops = (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t) + 1);
+        rs[t].blocks = (char **)calloc(trace->num_ids + 1, sizeof(char *));
+        if (rs[t].ops == NULL || rs[t].blocks == NULL)
+            unix_error("malloc in replay_trace failed");
+    }
+    for (i = 0; i < trace->num_ops; i++) {
+        t = (trace->ops[i].index < 0) ? 0 : trace->ops[i].index % nthreads;
+        rs[t].ops[rs[t].num_ops++] = trace->ops[i];
+        num_frees += (trace->ops[i].type == FREE ||
+                      trace->ops[i].type == FREE_BATCH);
+    }
+    if (remote && nthreads > 1) {
+        for (t = 0; t < nthreads; t++) {
+            pthread_mutex_init(&qs[t].lock, NULL);
+            if ((qs[t].items = (void **)malloc((num_frees + 1) * sizeof(void *))) == NULL)
+                unix_error("malloc in replay_trace failed");
+            rs[t].inq = &qs[t];
+            rs[t].outq = &qs[(t + 1) % nthreads];
+        }
+    }
+
+    for (run = 0; run < REPLAY_RUNS; run++) {
+        if (fns == &mm_fns) {
+            mem_reset_brk();
+            if (mm_init() < 0)
+                app_error("mm_init failed in replay_trace");
+        }
+        pthread_barrier_init(&replay_barrier, NULL, nthreads + 1);
+        for (t = 0; t < nthreads; t++)
+            if (pthread_create(&tids[t], NULL, replay_thread, &rs[t]) != 0)
+                app_error("pthread_create failed in replay_trace");
+
+        pthread_barrier_wait(&replay_barrier);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_barrier_wait(&replay_barrier);
+        pthread_barrier_wait(&replay_barrier);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        for (t = 0; t < nthreads; t++)
+            pthread_join(tids[t], NULL);
+        pthread_barrier_destroy(&replay_barrier);
+
+        wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (wall < best) {
+            best = wall;
+            for (t = 0; t < nthreads; t++) {
+                thread_secs[t] = rs[t].secs;
+                thread_ops[t] = rs[t].num_ops;
+            }
+        }
+
+        /* Release what the trace left allocated */
+        for (t = 0; t < nthreads; t++)
+            for (i = 0; i < trace->num_ids; i++)
+                if (rs[t].blocks[i] != NULL) {
+                    fns->free(rs[t].blocks[i]);
+                    rs[t].blocks[i] = NULL;
+                }
+    }
+
+    for (t = 0; t < nthreads; t++) {
+        free(rs[t].ops);
+        free(rs[t].blocks);
+        if (qs[t].items != NULL) {
+            free(qs[t].items);
+            pthread_mutex_destroy(&qs[t].lock);
+        }
+    }
+    free(rs);
+    free(qs);
+    free(tids);
+    return best;
+}
+
+/*
+ * run_replay - Replay the traces on 1 to max_threads threads, first with
+ *     each block freed by the thread that allocated it and then by another
+ *     thread. Prints the aggregate throughput, the scaling efficiency
+ *     against one thread, and the mean and worst per-thread latency.
+ */
+static void run_replay(int max_threads, const alloc_t *fns,
+                       int num_tracefiles, trace_t **traces)
+{
+    static const char *frees[2] = {
+        "frees on the allocating thread", "frees on the next thread"
+    };
+    double *tsecs, *secs;
+    int *tops, *ops;
+    double wall, total_ops, base = 0, kops, lat, avg, max;
+    int remote, n, i, t, k;
+
+    tsecs = (double *)malloc(max_threads * sizeof(double));
+    secs = (double *)malloc(max_threads * sizeof(double));
+    tops = (int *)malloc(max_threads * sizeof(int));
+    ops = (int *)malloc(max_threads * sizeof(int));
+    if (tsecs == NULL || secs == NULL || tops == NULL || ops == NULL)
+        unix_error("malloc in run_replay failed");
+
+    for (remote = 0; remote < 2; remote++) {
+        printf("\nReplay on 1 to %d threads, %s malloc, %s:\n",
+               max_threads, fns->name, frees[remote]);
+        printf("%7s %10s %7s %10s %10s\n",
+               "threads", "Kops", "eff", "ns/op avg", "ns/op max");
+        for (n = 1; n <= max_threads; n++) {
+            wall = total_ops = 0;
+            for (t = 0; t < n; t++) {
+                tsecs[t] = 0;
+                tops[t] = 0;
+            }
+            for (i = 0; i < num_tracefiles; i++) {
+                wall += replay_trace(traces[i], n, remote, fns, secs, ops);
+                total_ops += traces[i]->num_ops;
+                for (t = 0; t < n; t++) {
+                    tsecs[t] += secs[t];
+                    tops[t] += ops[t];
+                }
+            }
+
+            /* Latency of each thread over all the traces */
+            avg = max = 0;
+            for (t = k = 0; t < n; t++) {
+                if (tops[t] == 0)
+                    continue;
+                lat = tsecs[t] / tops[t] * 1e9;
+                avg += lat;
+                max = (lat > max) ? lat : max;
+                k++;
+            }
+            avg = k ? avg / k : 0;
+
+            kops = total_ops / wall / 1e3;
+            if (n == 1)
+                base = kops;
+            printf("%7d %10.0f %6.1f%% %10.1f %10.1f\n",
+                   n, kops, 100.0 * kops / (n * base), avg, max);
+        }
+    }
+    free(tsecs);
+    free(secs);
+    free(tops);
+    free(ops);
+}
+
 /**************
  * Main routine
  **************/
@@ -267,6 +758,10 @@ int main(int argc, char **argv)
 
     int run_libc = 0;     /* If set, run libc malloc (set by -l) */
     int autograder = 0;   /* if set then called by autograder (-A) */
+    int compare_policies = 0; /* If set, run mm once per policy (set by -P) */
+    int compare_coalesce = 0; /* If set, run mm once per coalescing mode (-C) */
+    int replay_threads = 0;   /* If set, replay on up to this many threads (-T) */
+    int latency_flag = 0;     /* If set, time each mm request (set by -L) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput = 0, p1, p2, perfindex;
@@ -280,7 +775,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:j:s:t:v:hVAlDPCLH:R:T:")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -318,6 +813,35 @@ int main(int argc, char **argv)
             run_libc = 1;
             break;
 
+        case 'P': /* Compare the placement policies of mm.c */
+            compare_policies = 1;
+            break;
+
+        case 'C': /* Compare eager and deferred coalescing in mm.c */
+            compare_coalesce = 1;
+            break;
+
+        case 'H': /* Dump the heap at its peak in each trace to a file */
+            if (mm_dump == NULL)
+                app_error("mm.c does not provide mm_dump\n");
+            if ((heap_dump_fp = fopen(optarg, "w")) == NULL)
+                unix_error("Could not open heap dump file");
+            break;
+
+        case 'R': /* Append the results of each trace to a CSV file */
+            if ((results_fp = fopen(optarg, "a")) == NULL)
+                unix_error("Could not open results file");
+            break;
+
+        case 'L': /* Report the latency distribution of each request type */
+            latency_flag = 1;
+            break;
+
+        case 'T': /* Replay the traces on 1 to n threads */
+            if ((replay_threads = atoi(optarg)) < 1)
+                app_error("-T needs at least one thread\n");
+            break;
+
         case 'V': /* Increase verbosity level */
             verbose += 1;
             break;
@@ -338,6 +862,11 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'j': /* Check this many traces for correctness at once */
+            if ((check_jobs = atoi(optarg)) < 1)
+                app_error("-j needs at least one process\n");
+            break;
+
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -358,6 +887,12 @@ int main(int argc, char **argv)
         init_random_data();
     }
 
+    if (latency_flag) {
+        latency = (lat_t *)malloc(num_tracefiles * sizeof(lat_t));
+        if (latency == NULL)
+            unix_error("latency malloc in main failed");
+    }
+
     /* Initialize the timing package */
     init_fsecs();
 
@@ -367,6 +902,33 @@ int main(int argc, char **argv)
         alarm(set_timeout); 
     }
 
+    /*
+     * Optionally replay the traces concurrently, on mm and with -l also
+     * on libc, and stop
+     */
+    if (replay_threads) {
+        trace_t **traces;
+        stats_t stats;
+
+        if (replay_threads > 1 && (mm_thread_safe == NULL || !mm_thread_safe()))
+            app_error("mm.c does not report itself thread safe in mm_thread_safe\n");
+        if ((traces = (trace_t **)malloc(num_tracefiles * sizeof(trace_t *))) == NULL)
+            unix_error("traces malloc in main failed");
+        for (i = 0; i < num_tracefiles; i++)
+            traces[i] = read_trace(&stats, tracedir, tracefiles[i]);
+
+        mem_init();
+        run_replay(replay_threads, &mm_fns, num_tracefiles, traces);
+        mem_deinit();
+        if (run_libc)
+            run_replay(replay_threads, &libc_fns, num_tracefiles, traces);
+
+        for (i = 0; i < num_tracefiles; i++)
+            free_trace(traces[i]);
+        free(traces);
+        exit(0);
+    }
+
     /*
      * Optionally run and evaluate the libc malloc package
      */
@@ -400,7 +962,28 @@ int main(int argc, char **argv)
             printf("\nResults for libc malloc:\n");
             printresults(num_tracefiles, libc_stats);
         }
+        if (results_fp != NULL)
+            writeresults("libc", num_tracefiles, libc_stats, NULL);
+    }
+
+    /*
+     * Optionally run the mm package once per placement policy or
+     * coalescing mode on the same traces, report each, and stop
+     */
+    if (compare_policies) {
+        if (mm_set_policy == NULL)
+            app_error("mm.c does not provide mm_set_policy\n");
+        run_modes(mm_set_policy, policy_names, MM_POLICY_NUM,
+                  num_tracefiles, tracefiles, ranges, &speed_params);
+    }
+    if (compare_coalesce) {
+        if (mm_set_coalesce == NULL)
+            app_error("mm.c does not provide mm_set_coalesce\n");
+        run_modes(mm_set_coalesce, coalesce_names, MM_COALESCE_NUM,
+                  num_tracefiles, tracefiles, ranges, &speed_params);
     }
+    if (compare_policies || compare_coalesce)
+        exit(errors ? 1 : 0);
 
     /*
      * Always run and evaluate the student's mm package
@@ -415,6 +998,12 @@ int main(int argc, char **argv)
 
     run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
               ranges, &speed_params);
+    if (results_fp != NULL) {  /* Rows are named after this driver */
+        char *name = strrchr(argv[0], '/');
+
+        writeresults(name ? name + 1 : argv[0], num_tracefiles, mm_stats, latency);
+        fclose(results_fp);
+    }
 
 
     /* Display the mm results in a compact table */
@@ -430,6 +1019,10 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_tracefiles, mm_stats);
             printf("\n");
+            if (latency != NULL) {
+                printlatency(num_tracefiles, mm_stats, latency);
+                printf("\n");
+            }
         }
     }
 
@@ -546,22 +1139,71 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range tree, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks. It is a
+ * treap ordered by lo, so each request costs O(log n) expected time
+ * in the number of live blocks.
  ****************************************************************/
 
+/*
+ * range_prio - The next of a fixed series of random treap priorities,
+ *     kept apart from rand() so as not to change the random_data
+ */
+static unsigned int range_prio(void)
+{
+    static unsigned int x = 2463534242u;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+/*
+ * split_ranges - Split tree t into the ranges below lo and the rest
+ */
+static void split_ranges(range_t *t, char *lo, range_t **below, range_t **rest)
+{
+    if (t == NULL) {
+        *below = *rest = NULL;
+    } else if (t->lo < lo) {
+        split_ranges(t->right, lo, &t->right, rest);
+        *below = t;
+    } else {
+        split_ranges(t->left, lo, below, &t->left);
+        *rest = t;
+    }
+}
+
+/*
+ * merge_ranges - Join two trees, all of whose ranges in l lie below r
+ */
+static range_t *merge_ranges(range_t *l, range_t *r)
+{
+    if (l == NULL)
+        return r;
+    if (r == NULL)
+        return l;
+    if (l->prio > r->prio) {
+        l->right = merge_ranges(l->right, r);
+        return l;
+    }
+    r->left = merge_ranges(l, r->left);
+    return r;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range struct for this block and add it to the range tree.
  */
 static int add_range(range_t **ranges, char *lo, int size,
                      const trace_t *trace, int opnum, int index)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *below, *rest;
 
     assert(size > 0);
 
@@ -581,15 +1223,16 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* If we can't afford the linear-time loop, we check less thoroughly and
-       just assume the overlap will be caught by writing random bits. */
-    if(trace->ignore_ranges || debug_mode == DBG_NONE) return 1;
-
+    /* With debugging off we check less thoroughly. The tree makes the
+       overlap check cheap, so traces with ignore_ranges get it too. */
+    if (debug_mode == DBG_NONE) return 1;
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
+    /*
+     * The payload must not overlap any other payloads. The ranges are
+     * disjoint, so any that overlaps lies on the search path for lo.
+     */
+    for (p = *ranges;  p != NULL;  p = (hi < p->lo) ? p->left : p->right) {
+        if (lo <= p->hi && hi >= p->lo) {
             malloc_error(trace, opnum,
                          "Payload (%p:%p) overlaps another payload (%p:%p)\n",
                          lo, hi, p->lo, p->hi);
@@ -599,15 +1242,17 @@ static int add_range(range_t **ranges, char *lo, int size,
 
     /*
      * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
         unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
+    p->left = p->right = NULL;
+    p->prio = range_prio();
     p->index = index;
-    *ranges = p;
+    split_ranges(*ranges, lo, &below, &rest);
+    *ranges = merge_ranges(merge_ranges(below, p), rest);
 
     return 1;
 }
@@ -617,16 +1262,23 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
+    range_t *below, *p, *rest;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-            *prevpp = p->next;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    split_ranges(*ranges, lo, &below, &rest);
+    split_ranges(rest, lo + 1, &p, &rest);
+    free(p);                    /* lo's range alone, if there is one */
+    *ranges = merge_ranges(below, rest);
+}
+
+/*
+ * free_ranges - free the range records of tree r
+ */
+static void free_ranges(range_t *r)
+{
+    if (r != NULL) {
+        free_ranges(r->left);
+        free_ranges(r->right);
+        free(r);
     }
 }
 
@@ -635,14 +1287,19 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    free_ranges(*ranges);
+    *ranges = NULL;
+}
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+/*
+ * check_ranges - check the random data of every block in tree r
+ */
+static void check_ranges(const trace_t *trace, int opnum, const range_t *r)
+{
+    for (; r != NULL; r = r->right) {
+        check_ranges(trace, opnum, r->left);
+        check_index(trace, opnum, r->index);
     }
-    *ranges = NULL;
 }
 
 /**********************************************
@@ -712,17 +1369,164 @@ static void check_index(const trace_t *trace, int opnum, int index) {
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * parse_trace - read the requests of a text .rep file, whose header
+ *     has been read, into a new ops array
+ */
+static void parse_trace(trace_t *trace, FILE *tracefile)
+{
+    char type[MAXLINE];
+    int index, size = 0;
+    int max_index = 0;
+    int op_index;
+    int n, k, line;
+
+    /* We'll store each request line in the trace in this array... */
+    if ((trace->ops =
+         (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+        unix_error("malloc 2 failed in read_trace");
+
+    /* ... and the line it came from, since a batch line holds several */
+    if ((trace->lines = (int *)malloc(trace->num_ops * sizeof(int))) == NULL)
+        unix_error("malloc 7 failed in read_trace");
+
+    /* read every request line in the trace file */
+    index = 0;
+    op_index = 0;
+    line = HDRLINES + 1;
+    while (fscanf(tracefile, "%s", type) != EOF) {
+        trace->lines[op_index] = line;
+        switch(type[0]) {
+        case 'a':
+            fscanf(tracefile, "%u %u", &index, &size);
+            trace->ops[op_index].type = ALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].batch = 0;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'r':
+            fscanf(tracefile, "%u %u", &index, &size);
+            trace->ops[op_index].type = REALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].batch = 0;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'f':
+            fscanf(tracefile, "%ud", &index);
+            trace->ops[op_index].type = FREE;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = 0;
+            trace->ops[op_index].batch = 0;
+            break;
+        case 'A':
+        case 'F':
+            /* A batch line stands for n requests on ids index..index+n-1 */
+            n = 0;
+            if (type[0] == 'A')
+                fscanf(tracefile, "%u %u %u", &index, &n, &size);
+            else
+                fscanf(tracefile, "%u %u", &index, &n);
+            if (n < 1 || n > trace->num_ops - op_index ||
+                index + n > trace->num_ids)
+                app_error("Bad batch of %d at request %d in tracefile %s\n",
+                          n, op_index, trace->filename);
+            for (k = 0; k < n; k++) {
+                trace->ops[op_index + k].type =
+                    (type[0] == 'A') ? ALLOC_BATCH : FREE_BATCH;
+                trace->ops[op_index + k].index = index + k;
+                trace->ops[op_index + k].size = (type[0] == 'A') ? size : 0;
+                trace->ops[op_index + k].batch = (k == 0) ? n : 0;
+                trace->lines[op_index + k] = line;
+            }
+            if (type[0] == 'A' && index + n - 1 > max_index)
+                max_index = index + n - 1;
+            op_index += n - 1;
+            break;
+        default:
+            app_error("Bogus type character (%c) in tracefile %s\n",
+                      type[0], trace->filename);
+        }
+        op_index++;
+        line++;
+        if(op_index == trace->num_ops) break;
+    }
+    assert(max_index == trace->num_ids - 1);
+    assert(trace->num_ops == op_index);
+}
+
+/*
+ * map_trace - map the records of a binary trace as the ops array. The
+ *     requests are not parsed, only checked against the header.
+ */
+static void map_trace(trace_t *trace, FILE *tracefile)
+{
+    tracehdr_t *hdr;
+    struct stat st;
+    int i, n, k;
+
+    if (fstat(fileno(tracefile), &st) < 0)
+        unix_error("Could not stat %s in read_trace", trace->filename);
+    if ((size_t)st.st_size < sizeof(tracehdr_t))
+        app_error("%s: truncated binary trace header", trace->filename);
+    trace->map_len = st.st_size;
+    trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE,
+                      fileno(tracefile), 0);
+    if (trace->map == MAP_FAILED)
+        unix_error("Could not map %s in read_trace", trace->filename);
+
+    hdr = (tracehdr_t *)trace->map;
+    if (hdr->op_size != sizeof(traceop_t))
+        app_error("%s: records of %u bytes, expected %u", trace->filename,
+                  hdr->op_size, (unsigned)sizeof(traceop_t));
+    if (hdr->num_ops < 0 || hdr->num_ids < 0 ||
+        (size_t)st.st_size != sizeof(tracehdr_t) +
+        (size_t)hdr->num_ops * sizeof(traceop_t))
+        app_error("%s: size does not match %d ops", trace->filename,
+                  hdr->num_ops);
+    trace->weight = hdr->weight;
+    trace->num_ids = hdr->num_ids;
+    trace->num_ops = hdr->num_ops;
+    trace->ignore_ranges = hdr->ignore_ranges;
+    trace->ops = (traceop_t *)(hdr + 1);
+
+    madvise(trace->map, trace->map_len, MADV_SEQUENTIAL);
+    for (i = 0; i < trace->num_ops; i++)
+        if (trace->ops[i].type > FREE_BATCH ||
+            trace->ops[i].index >= trace->num_ids ||
+            (trace->ops[i].index < 0 && trace->ops[i].type != FREE))
+            app_error("%s: bad record %d", trace->filename, i);
+
+    /* Each batch is its first record's length of records like it */
+    for (i = 0; i < trace->num_ops; i += n) {
+        n = 1;
+        if (trace->ops[i].type == ALLOC_BATCH ||
+            trace->ops[i].type == FREE_BATCH) {
+            n = trace->ops[i].batch;
+            if (n < 1 || n > trace->num_ops - i)
+                app_error("%s: bad batch length at record %d",
+                          trace->filename, i);
+            for (k = 1; k < n; k++)
+                if (trace->ops[i + k].type != trace->ops[i].type ||
+                    trace->ops[i + k].size != trace->ops[i].size ||
+                    trace->ops[i + k].batch != 0)
+                    app_error("%s: record %d does not continue its batch",
+                              trace->filename, i + k);
+        } else if (trace->ops[i].batch != 0)
+            app_error("%s: batch length on record %d", trace->filename, i);
+    }
+}
+
+/*
+ * read_trace - read a trace file, text or binary, and store it in memory
  */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename)
 {
     FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
-    int index, size;
-    int max_index = 0;
-    int op_index;
+    char magic[TRACE_MAGIC_LEN];
+    int i;
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -737,10 +1541,18 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     if ((tracefile = fopen(trace->filename, "r")) == NULL) {
         unix_error("Could not open %s in read_trace", trace->filename);
     }
-    fscanf(tracefile, "%d", &trace->weight);
-    fscanf(tracefile, "%d", &trace->num_ids);
-    fscanf(tracefile, "%d", &trace->num_ops);
-    fscanf(tracefile, "%d", &trace->ignore_ranges);
+    trace->map = NULL;
+    trace->lines = NULL;
+    if (fread(magic, 1, TRACE_MAGIC_LEN, tracefile) != TRACE_MAGIC_LEN ||
+        memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        rewind(tracefile);
+        fscanf(tracefile, "%d", &trace->weight);
+        fscanf(tracefile, "%d", &trace->num_ids);
+        fscanf(tracefile, "%d", &trace->num_ops);
+        fscanf(tracefile, "%d", &trace->ignore_ranges);
+    }
+    else
+        map_trace(trace, tracefile);
 
     if(trace->weight < 0 || trace->weight > 3) {
         app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
@@ -749,11 +1561,6 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
         app_error("%s: ignore-ranges can only be zero or one", trace->filename);
     }
 
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
-         (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-        unix_error("malloc 2 failed in read_trace");
-
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks =
          (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
@@ -769,41 +1576,21 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
          calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
+    if (trace->map == NULL)
+        parse_trace(trace, tracefile);
+    fclose(tracefile);
 
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-        switch(type[0]) {
-        case 'a':
-            fscanf(tracefile, "%u %u", &index, &size);
-            trace->ops[op_index].type = ALLOC;
-            trace->ops[op_index].index = index;
-            trace->ops[op_index].size = size;
-            max_index = (index > max_index) ? index : max_index;
+    /* Batches hand their blocks to mm_malloc_batch and mm_free_batch here */
+    trace->batch = NULL;
+    trace->batch_base = trace->batch_end = 0;
+    for (i = 0; i < trace->num_ops; i++)
+        if (trace->ops[i].type == ALLOC_BATCH ||
+            trace->ops[i].type == FREE_BATCH) {
+            if ((trace->batch =
+                 (void **)malloc(trace->num_ops * sizeof(void *))) == NULL)
+                unix_error("malloc 6 failed in read_trace");
             break;
-        case 'r':
-            fscanf(tracefile, "%u %u", &index, &size);
-            trace->ops[op_index].type = REALLOC;
-            trace->ops[op_index].index = index;
-            trace->ops[op_index].size = size;
-            max_index = (index > max_index) ? index : max_index;
-            break;
-        case 'f':
-            fscanf(tracefile, "%ud", &index);
-            trace->ops[op_index].type = FREE;
-            trace->ops[op_index].index = index;
-            break;
-        default:
-            app_error("Bogus type character (%c) in tracefile %s\n",
-                      type[0], trace->filename);
         }
-        op_index++;
-        if(op_index == trace->num_ops) break;
-    }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
 
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
@@ -821,21 +1608,97 @@ static void reinit_trace(trace_t *trace)
     memset(trace->blocks, 0, trace->num_ids * sizeof(*trace->blocks));
     memset(trace->block_sizes, 0, trace->num_ids * sizeof(*trace->block_sizes));
     /* block_rand_base is unused if size is zero */
+    trace->batch_base = trace->batch_end = 0;
 }
 
 /*
- * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ * free_trace - Free the trace record and the six arrays it points
+ *              to, all of which were allocated or mapped in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
-    free(trace->blocks);
+    if (trace->map != NULL)   /* unmap or free the requests... */
+        munmap(trace->map, trace->map_len);
+    else
+        free(trace->ops);
+    free(trace->lines);       /* their lines, if text... */
+    free(trace->blocks);      /* the three arrays... */
     free(trace->block_sizes);
     free(trace->block_rand_base);
+    free(trace->batch);
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * op_line - The line of the trace file that request opnum came from.
+ *     A binary trace has no lines, so LINENUM of the record stands in.
+ */
+static int op_line(const trace_t *trace, int opnum)
+{
+    return (trace->lines != NULL) ? trace->lines[opnum] : LINENUM(opnum);
+}
+
+/*
+ * batch_len - The number of requests in the batch that starts at
+ *     opnum, as its first record says
+ */
+static int batch_len(const trace_t *trace, int opnum)
+{
+    return trace->ops[opnum].batch;
+}
+
+/*
+ * batch_alloc - The block for ALLOC_BATCH request opnum. The batch's
+ *     first request allocates all of its blocks with one call to
+ *     mm_malloc_batch, or to mm_malloc per block if mm.c has none;
+ *     blocks it could not allocate are NULL.
+ */
+static char *batch_alloc(trace_t *trace, int opnum)
+{
+    size_t n, got;
+    size_t size = trace->ops[opnum].size;
+
+    if (opnum >= trace->batch_end) {
+        n = batch_len(trace, opnum);
+        trace->batch_base = opnum;
+        trace->batch_end = opnum + n;
+        if (mm_malloc_batch != NULL)
+            got = mm_malloc_batch(size, n, trace->batch);
+        else
+            for (got = 0; got < n; got++)
+                if ((trace->batch[got] = mm_malloc(size)) == NULL)
+                    break;
+        while (got < n)
+            trace->batch[got++] = NULL;
+    }
+    return trace->batch[opnum - trace->batch_base];
+}
+
+/*
+ * batch_free - Free block p of FREE_BATCH request opnum. The blocks
+ *     are held until the batch's last request, which frees them all
+ *     with one call to mm_free_batch, or to mm_free per block.
+ */
+static void batch_free(trace_t *trace, int opnum, char *p)
+{
+    int i, n;
+
+    if (opnum >= trace->batch_end) {
+        trace->batch_base = opnum;
+        trace->batch_end = opnum + batch_len(trace, opnum);
+    }
+    trace->batch[opnum - trace->batch_base] = p;
+    if (opnum < trace->batch_end - 1)
+        return;
+
+    n = trace->batch_end - trace->batch_base;
+    if (mm_free_batch != NULL)
+        mm_free_batch(trace->batch, n);
+    else
+        for (i = 0; i < n; i++)
+            mm_free(trace->batch[i]);
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
@@ -853,7 +1716,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
     char *oldp;
     char *p;
 
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
     reinit_trace(trace);
@@ -870,32 +1733,31 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
         size = trace->ops[i].size;
 
         if(debug_mode == DBG_EXPENSIVE) {
-            range_t *r;
-                        
             /* Let the students check their own heap */
             mm_checkheap(verbose);
 
             /* Now check that all our allocated blocks have the right data */
-            r = *ranges;
-            while(r) {
-                check_index(trace, i, r->index);
-                r = r->next;
-            }
+            check_ranges(trace, i, *ranges);
         }
 
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case ALLOC_BATCH: /* mm_malloc_batch */
 
             /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
+            if (trace->ops[i].type == ALLOC)
+                p = mm_malloc(size);
+            else
+                p = batch_alloc(trace, i);
+            if (p == NULL) {
                 malloc_error(trace, i, "mm_malloc failed.");
                 return 0;
             }
 
             /*
              * Test the range of the new block for correctness and add it
-             * to the range list if OK. The block must be  be aligned properly,
+             * to the range tree if OK. The block must be  be aligned properly,
              * and must not overlap any currently allocated block.
              */
             if (add_range(ranges, p, size, trace, i, index) == 0)
@@ -926,10 +1788,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
             }
 
 
-            /* Remove the old region from the range list */
+            /* Remove the old region from the range tree */
             remove_range(ranges, oldp);
 
-            /* Check new block for correctness and add it to range list */
+            /* Check new block for correctness and add it to range tree */
             if (size > 0) {
                 if(add_range(ranges, newp, size, trace, i, index) == 0)
                     return 0;
@@ -950,6 +1812,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
             break;
 
         case FREE: /* mm_free */
+        case FREE_BATCH: /* mm_free_batch */
             check_index(trace, i, index);
 
             /* Remove region from list and call student's free function */
@@ -959,7 +1822,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
                 p = trace->blocks[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            if (trace->ops[i].type == FREE)
+                mm_free(p);
+            else
+                batch_free(trace, i, p);
             break;
 
         default:
@@ -991,6 +1857,9 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    int peak_ops = 0;
+    size_t peak_heap = 0;
+    double util;
     char *p;
     char *newp, *oldp;
 
@@ -1005,10 +1874,15 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case ALLOC_BATCH: /* mm_malloc_batch */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL) {
+            if (trace->ops[i].type == ALLOC)
+                p = mm_malloc(size);
+            else
+                p = batch_alloc(trace, i);
+            if (p == NULL) {
                 app_error("trace %d: mm_malloc failed in eval_mm_util",
                           tracenum);
             }
@@ -1039,6 +1913,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             break;
 
         case FREE: /* mm_free */
+        case FREE_BATCH: /* mm_free_batch */
             index = trace->ops[i].index;
             if(index < 0) {
                 size = 0;
@@ -1048,7 +1923,10 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            if (trace->ops[i].type == FREE)
+                mm_free(p);
+            else
+                batch_free(trace, i, p);
 
             total_size -= size;
             break;
@@ -1061,11 +1939,85 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
+
+        /* and remember after how many ops the heap last grew */
+        if (mem_heapsize() > peak_heap) {
+            peak_heap = mem_heapsize();
+            peak_ops = i + 1;
+        }
     }
 
     printf(".");
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    /* the snapshot replays the trace, so take the ratio first */
+    util = (double)max_total_size / (double)mem_heapsize();
+    if (heap_dump_fp != NULL)
+        dump_mm_heap(trace, tracenum, peak_ops);
+    return util;
+}
+
+/*
+ * dump_mm_heap - Replay the first num_ops requests of the trace and
+ *     write a snapshot of the heap, as mm_dump prints it, to the -H file
+ */
+static void dump_mm_heap(trace_t *trace, int tracenum, int num_ops)
+{
+    int i, index, bad;
+    char *p;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("trace %d: mm_init failed in dump_mm_heap", tracenum);
+
+    for (i = 0; i < num_ops; i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_alloc */
+            if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+                app_error("trace %d: mm_malloc failed in dump_mm_heap",
+                          tracenum);
+            trace->blocks[index] = p;
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            if ((p = batch_alloc(trace, i)) == NULL)
+                app_error("trace %d: mm_malloc_batch failed in dump_mm_heap",
+                          tracenum);
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+            if (p == NULL && trace->ops[i].size != 0)
+                app_error("trace %d: mm_realloc failed in dump_mm_heap",
+                          tracenum);
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(index < 0 ? NULL : trace->blocks[index]);
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            batch_free(trace, i, trace->blocks[index]);
+            break;
+
+        default:
+            app_error("trace %d: Nonexistent request type in dump_mm_heap",
+                      tracenum);
+        }
+    }
+
+    fprintf(heap_dump_fp, "# %s after %d of %d ops, heap %zu bytes\n",
+            trace->filename, num_ops, trace->num_ops, mem_heapsize());
+    if ((bad = mm_dump(heap_dump_fp)) != 0) {
+        fprintf(heap_dump_fp, "# %d blocks disagree with the free lists\n", bad);
+        printf("\ntrace %d: %d heap blocks disagree with the free lists\n",
+               tracenum, bad);
+    }
+    fflush(heap_dump_fp);
 }
 
 
@@ -1097,6 +2049,13 @@ static void eval_mm_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            if ((p = batch_alloc(trace, i)) == NULL)
+                app_error("mm_malloc_batch error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1116,11 +2075,148 @@ static void eval_mm_speed(void *ptr)
             mm_free(block);
             break;
 
+        case FREE_BATCH: /* mm_free_batch */
+            batch_free(trace, i, trace->blocks[trace->ops[i].index]);
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_speed");
         }
 }
 
+/*
+ * hist_bucket - The latency histogram bucket that holds v cycles
+ */
+static int hist_bucket(unsigned long v)
+{
+    int e;
+
+    if (v < 2 * HIST_SUB)
+        return v;
+    e = 63 - __builtin_clzl(v);         /* 2^e <= v < 2^(e+1) */
+    return (e - HIST_SUB_BITS) * HIST_SUB + (v >> (e - HIST_SUB_BITS));
+}
+
+/*
+ * hist_high - The largest number of cycles held by bucket i
+ */
+static unsigned long hist_high(int i)
+{
+    int shift;
+
+    if (i < 2 * HIST_SUB - 1)
+        return i;
+    i++;                                /* Lowest value of bucket i+1, less one */
+    shift = i / HIST_SUB - 1;
+    return ((unsigned long)(i % HIST_SUB + HIST_SUB) << shift) - 1;
+}
+
+/*
+ * eval_mm_latency - Replay a trace once, timing each mm request with
+ *     the cycle counter, less its own overhead, into lat. A batch is
+ *     timed as one call whose cost is shared by its n requests, and
+ *     listed once among the slowest.
+ */
+static void eval_mm_latency(trace_t *trace, lat_t *lat)
+{
+    int i, j, k, n, index, type, size;
+    char *p = NULL, *block;
+    double overhead, c;
+    unsigned long cycles;
+
+    memset(lat, 0, sizeof(*lat));
+    reinit_trace(trace);
+    /* The cheapest of many empty timings is the counter's own cost */
+    overhead = DBL_MAX;
+    for (i = 0; i < 100; i++) {
+        start_counter();
+        c = get_counter();
+        if (c < overhead)
+            overhead = c;
+    }
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i += n) {
+        type = trace->ops[i].type;
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        n = 1;
+        switch (type) {
+
+        case ALLOC: /* mm_malloc */
+            start_counter();
+            p = mm_malloc(size);
+            c = get_counter();
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch, then hand out its blocks */
+            n = batch_len(trace, i);
+            start_counter();
+            p = batch_alloc(trace, i);
+            c = get_counter();
+            for (k = 0; k < n; k++) {
+                if ((p = batch_alloc(trace, i + k)) == NULL)
+                    app_error("mm_malloc_batch error in eval_mm_latency");
+                trace->blocks[trace->ops[i + k].index] = p;
+            }
+            type = ALLOC;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            block = trace->blocks[index];
+            start_counter();
+            p = mm_realloc(block, size);
+            c = get_counter();
+            if (p == NULL && size != 0)
+                app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            block = (index < 0) ? NULL : trace->blocks[index];
+            start_counter();
+            mm_free(block);
+            c = get_counter();
+            break;
+
+        case FREE_BATCH: /* collect its blocks, then mm_free_batch */
+            n = batch_len(trace, i);
+            for (k = 0; k < n - 1; k++)
+                batch_free(trace, i + k, trace->blocks[trace->ops[i + k].index]);
+            block = trace->blocks[trace->ops[i + n - 1].index];
+            start_counter();
+            batch_free(trace, i + n - 1, block);
+            c = get_counter();
+            type = FREE;
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_latency");
+        }
+
+        cycles = (c > overhead) ? (unsigned long)(c - overhead) / n : 0;
+        lat->count[type] += n;
+        lat->hist[type][hist_bucket(cycles)] += n;
+        if (cycles > lat->max[type])
+            lat->max[type] = cycles;
+
+        /* Keep the slowest requests, slowest first */
+        if (cycles <= lat->worst[WORST_NUM-1].cycles)
+            continue;
+        for (j = WORST_NUM-1; j > 0 && cycles > lat->worst[j-1].cycles; j--)
+            lat->worst[j] = lat->worst[j-1];
+        lat->worst[j].cycles = cycles;
+        lat->worst[j].line = op_line(trace, i);
+        lat->worst[j].type = type;
+    }
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1138,6 +2234,7 @@ static int eval_libc_valid(trace_t *trace)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* malloc */
+        case ALLOC_BATCH:
             if ((p = malloc(trace->ops[i].size)) == NULL) {
                 malloc_error(trace, i, "libc malloc failed");
                 unix_error("System message");
@@ -1156,6 +2253,7 @@ static int eval_libc_valid(trace_t *trace)
             break;
 
         case FREE: /* free */
+        case FREE_BATCH:
             if(trace->ops[i].index >= 0) {
                 free(trace->blocks[trace->ops[i].index]);
             } else {
@@ -1188,6 +2286,7 @@ static void eval_libc_speed(void *ptr)
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
+        case ALLOC_BATCH:
             index = trace->ops[i].index;
             size = trace->ops[i].size;
             if ((p = malloc(size)) == NULL)
@@ -1206,6 +2305,7 @@ static void eval_libc_speed(void *ptr)
             break;
 
         case FREE: /* free */
+        case FREE_BATCH:
             index = trace->ops[i].index;
             if(index >= 0) {
                 block = trace->blocks[index];
@@ -1358,31 +2458,150 @@ void unix_error(const char *fmt, ...) {
  */
 void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 {
+    char msg[MAXLINE];
     va_list ap;
     va_start(ap, fmt);
 
     errors++;
 
-    printf("ERROR [trace %s, line %d]: ", trace->filename, LINENUM(opnum));
-    vprintf(fmt, ap);
-    putchar('\n');
+    /* In one printf, so that the lines of -j processes don't mix */
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    printf("ERROR [trace %s, line %d]: %s\n", trace->filename, op_line(trace, opnum), msg);
 
     va_end(ap);
 }
 
+/*
+ * hist_percentile - The latency, in cycles, that a fraction p of the
+ *     type requests in lat did not exceed
+ */
+static unsigned long hist_percentile(const lat_t *lat, int type, double p)
+{
+    unsigned long target, sum = 0;
+    int i;
+
+    target = (unsigned long)(p * lat->count[type] + 0.999999);
+    if (target == 0)
+        target = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        sum += lat->hist[type][i];
+        if (sum >= target)
+            break;
+    }
+    return (hist_high(i) < lat->max[type]) ? hist_high(i) : lat->max[type];
+}
+
+/*
+ * printlatency - Print the latency percentiles of each request type in
+ *     each trace and over all of them, then the slowest requests by line
+ */
+static void printlatency(int n, stats_t *stats, lat_t *lat)
+{
+    static const char *types[3] = { "malloc", "free", "realloc" };
+    lat_t all;
+    int i, t, j, b;
+
+    memset(&all, 0, sizeof(all));
+    printf("Request latency in cycles for mm malloc:\n");
+    printf("%5s %-8s%10s%9s%9s%9s%12s\n",
+           "trace", "request", "ops", "p50", "p99", "p99.9", "max");
+    for (i = 0; i <= n; i++) {
+        const lat_t *l = (i < n) ? &lat[i] : &all;
+
+        if (i < n && !stats[i].valid)
+            continue;
+        for (t = 0; t < 3; t++) {
+            if (l->count[t] == 0)
+                continue;
+            if (i < n) {
+                printf("%5d ", i);
+                all.count[t] += l->count[t];
+                for (b = 0; b < HIST_BUCKETS; b++)
+                    all.hist[t][b] += l->hist[t][b];
+                if (l->max[t] > all.max[t])
+                    all.max[t] = l->max[t];
+            } else {
+                printf("%5s ", "Total");
+            }
+            printf("%-8s%10lu%9lu%9lu%9lu%12lu\n", types[t], l->count[t],
+                   hist_percentile(l, t, 0.50), hist_percentile(l, t, 0.99),
+                   hist_percentile(l, t, 0.999), l->max[t]);
+        }
+    }
+
+    printf("Slowest requests:\n");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        for (j = 0; j < WORST_NUM && lat[i].worst[j].cycles > 0; j++)
+            printf("%5d %-8s%10lu cycles at line %d of %s\n", i,
+                   types[lat[i].worst[j].type], lat[i].worst[j].cycles,
+                   lat[i].worst[j].line, stats[i].filename);
+    }
+}
+
+/*
+ * writeresults - Append a CSV row per trace to results_fp: the package
+ *     name, trace, validity, util, throughput and, with -L, the latency
+ *     percentiles over all its requests
+ */
+static void writeresults(const char *name, int n, stats_t *stats, lat_t *lat)
+{
+    lat_t all;
+    int i, t, b;
+
+    if (ftell(results_fp) == 0)
+        fprintf(results_fp, "allocator,trace,valid,util,ops,secs,kops,p50,p99,p999,max\n");
+    for (i = 0; i < n; i++) {
+        fprintf(results_fp, "%s,%s,%d,", name, stats[i].filename, stats[i].valid);
+        if (!stats[i].valid) {
+            fprintf(results_fp, ",,,,,,,\n");
+            continue;
+        }
+        fprintf(results_fp, "%.1f,%.0f,%.6f,%.0f,", stats[i].util * 100.0,
+                stats[i].ops, stats[i].secs,
+                (stats[i].secs > 0) ? stats[i].ops / 1e3 / stats[i].secs : 0);
+        if (lat == NULL) {
+            fprintf(results_fp, ",,,\n");
+            continue;
+        }
+
+        /* Fold the request types into the first */
+        all = lat[i];
+        for (t = 1; t < 3; t++) {
+            all.count[0] += all.count[t];
+            for (b = 0; b < HIST_BUCKETS; b++)
+                all.hist[0][b] += all.hist[t][b];
+            if (all.max[t] > all.max[0])
+                all.max[0] = all.max[t];
+        }
+        fprintf(results_fp, "%lu,%lu,%lu,%lu\n", hist_percentile(&all, 0, 0.50),
+                hist_percentile(&all, 0, 0.99), hist_percentile(&all, 0, 0.999),
+                all.max[0]);
+    }
+    fflush(results_fp);
+}
+
 /*
  * usage - Explain the command line arguments
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+    fprintf(stderr, "Usage: mdriver [-hlVdDPCL] [-H <file>] [-R <file>] [-T <n>] [-j <n>] [-f <file>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
     fprintf(stderr, "\t-c <file>  Run trace file <file> once, check for correctness only.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-j <n>     Check <n> traces for correctness at once, before timing.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-P         Compare the placement policies of mm.c, then exit.\n");
+    fprintf(stderr, "\t-C         Compare eager and deferred coalescing in mm.c, then exit.\n");
+    fprintf(stderr, "\t-L         Report latency percentiles and the slowest requests of mm.c.\n");
+    fprintf(stderr, "\t-R <file>  Append a CSV row of results per trace to <file>.\n");
+    fprintf(stderr, "\t-H <file>  Write a heap snapshot at each trace's peak to <file>.\n");
+    fprintf(stderr, "\t-T <n>     Replay the traces on 1 to <n> threads (-l adds libc), then exit.\n");
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
@@ -3,6 +3,7 @@
  *						allows us to interleave calls from the student's malloc package 
  *						with the system's malloc package in libc.
  */
+#define _GNU_SOURCE                 /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -12,6 +13,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
@@ -20,11 +22,54 @@
 static char *heap;
 static char *mem_brk;
 static char *mem_max_addr;
+static char *mem_peak;        /* highest break since the last reset */
+static char *mem_clean;       /* heap never handed out, so zero, from here */
+#if MEM_MMAP
+static char *mem_commit;      /* end of the committed chunks */
+#endif
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; /* guards mem_brk */
+
+#if MEM_MMAP
+/*
+ * mem_commit_to - commit whole chunks until the heap reaches end
+ */
+static int mem_commit_to(char *end) {
+	while (mem_commit < end) {
+		if (mmap(mem_commit, MEM_CHUNK, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+			return -1;
+		mem_commit += MEM_CHUNK;
+	}
+	return 0;
+}
+
+/*
+ * mem_decommit - give the chunks wholly above the break back to the OS.
+ *		The address range stays reserved.
+ */
+static void mem_decommit(void) {
+	char *top = heap + ((mem_brk - heap + MEM_CHUNK - 1) & ~(MEM_CHUNK - 1));
+
+	if (top < mem_commit) {
+		mmap(top, mem_commit - top, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+		mem_commit = top;
+		if (mem_clean > top)
+			mem_clean = top;		/* recommitted chunks read as zero */
+	}
+}
+#endif
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void){
+#if MEM_MMAP
+	/* reserve the address range only; chunks are committed on demand */
+	heap = mmap((void *)0x800000000, MAX_HEAP, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	mem_commit = heap;
+#else
 	int dev_zero = open("/dev/zero", O_RDWR);
 	heap = mmap((void *)0x800000000, /* suggested start*/
 			MAX_HEAP,				/* length */
@@ -32,8 +77,11 @@ void mem_init(void){
 			MAP_PRIVATE,			/* private or shared? */
 			dev_zero,				/* fd */
 			0);						/* offset (dunno) */
+#endif
 	mem_max_addr = heap + MAX_HEAP;
 	mem_brk = heap;					/* heap is empty initially */
+	mem_peak = heap;
+	mem_clean = heap;
 }
 
 /* 
@@ -48,25 +96,50 @@ void mem_deinit(void){
  */
 void mem_reset_brk(){
 	mem_brk = heap;
+	mem_peak = heap;
+#if MEM_MMAP
+	mem_decommit();
+#endif
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area.
+ *		A negative incr shrinks the heap, and with MEM_MMAP the chunks
+ *		left above the break are returned to the OS. Safe to call from
+ *		several threads at once.
  */
 void *mem_sbrk(int incr) {
-	char *old_brk = mem_brk;
+	char *old_brk;
+
+	pthread_mutex_lock(&mem_lock);
+	old_brk = mem_brk;
 
+#if MEM_MMAP
+	if (((mem_brk + incr) < heap) || ((mem_brk + incr) > mem_max_addr) ||
+			mem_commit_to(mem_brk + incr) < 0) {
+#else
     // call sbrk() in an attempt to have similar semantics as a real allocator.
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr) ||
-            sbrk(incr) == (void *) -1) {
+    // Shrinks are not passed on, since libc may own the top of the real brk.
+	if (((mem_brk + incr) < heap) || ((mem_brk + incr) > mem_max_addr) ||
+            (incr >= 0 && sbrk(incr) == (void *) -1)) {
+#endif
+		pthread_mutex_unlock(&mem_lock);
 		errno = ENOMEM;
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 		return (void *)-1;
 	}
 
 	mem_brk += incr;
+	if (mem_brk > mem_peak)
+		mem_peak = mem_brk;
+	if (mem_brk > mem_clean)
+		mem_clean = mem_brk;
+#if MEM_MMAP
+	if (incr < 0)
+		mem_decommit();
+#endif
+	pthread_mutex_unlock(&mem_lock);
 	return (void *)old_brk;
 }
 
@@ -85,10 +158,22 @@ void *mem_heap_hi(){
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heap_clean - return the first heap byte that mem_sbrk has never
+ *		handed out since it was mapped. The heap reads as zero from there
+ *		up, across mem_reset_brk too, so an allocator can skip clearing
+ *		memory above it.
+ */
+void *mem_heap_clean(){
+	return (void *)mem_clean;
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes. Once the heap has
+ *		been shrunk this is the highest break since the last reset,
+ *		which is what utilization is measured against.
  */
 size_t mem_heapsize() {
-	return (size_t)((void *)mem_brk - (void *)heap);
+	return (size_t)((void *)mem_peak - (void *)heap);
 }
 
 /*
@@ -97,3 +182,57 @@ size_t mem_heapsize() {
 size_t mem_pagesize(){
 	return (size_t)getpagesize();
 }
+
+/*
+ * mem_map - map size bytes of zeroed memory outside the modelled heap,
+ *		aligned to align (a power of two, at least the page size).
+ *		Pages are only committed once touched. Returns NULL on failure.
+ */
+void *mem_map(size_t size, size_t align) {
+	char *addr, *start;
+	size_t span = (align > mem_pagesize()) ? size + align : size;
+
+	addr = mmap(NULL, span, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	/* unmap the slack on either side of the aligned range */
+	start = (char *)(((size_t)addr + align - 1) & ~(align - 1));
+	if (start > addr)
+		munmap(addr, start - addr);
+	if (addr + span > start + size)
+		munmap(start + size, addr + span - (start + size));
+	return (void *)start;
+}
+
+/*
+ * mem_unmap - release a range returned by mem_map
+ */
+void mem_unmap(void *addr, size_t size) {
+	munmap(addr, size);
+}
+
+/*
+ * mem_remap - resize a range returned by mem_map with page alignment,
+ *		moving it if it cannot grow in place. The contents are kept
+ *		without copying. Returns NULL on failure, leaving the range as is.
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size) {
+	void *p = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+/*
+ * mem_release - tell the OS the whole pages inside [addr, addr+size)
+ *		are no longer needed. They stay mapped and read back as zero.
+ */
+void mem_release(void *addr, size_t size) {
+	size_t page = mem_pagesize();
+	size_t start = ((size_t)addr + page - 1) & ~(page - 1);
+	size_t end = ((size_t)addr + size) & ~(page - 1);
+
+	if (end > start)
+		madvise((void *)start, end - start, MADV_DONTNEED);
+}
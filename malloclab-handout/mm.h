@@ -20,5 +20,81 @@ extern void *calloc (size_t nmemb, size_t size);
 
 extern int mm_init(void);
 
+/* Allocate n blocks of size bytes into out, returning how many were
+ * allocated, and free n blocks, sorting ptrs; for allocators that
+ * support batches */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Free a block given the size requested for it, and allocate at a
+ * multiple of a power of two alignment; for allocators that support them */
+extern void mm_free_sized(void *ptr, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+
+/* Regions, for allocators that support them: blocks of a region are
+ * bump-allocated and only freed all at once, by mm_region_reset or
+ * mm_region_destroy */
+struct mm_region;
+
+extern struct mm_region *mm_region_create(size_t chunk_size);
+extern void *mm_region_alloc(struct mm_region *r, size_t size);
+extern void mm_region_reset(struct mm_region *r);
+extern void mm_region_destroy(struct mm_region *r);
+
+/* Placement policies, for allocators that support mm_set_policy */
+#define MM_FIRST_FIT   0   /* first block that fits, in list order */
+#define MM_BEST_FIT    1   /* tightest of a bounded number of candidates */
+#define MM_EXACT_FIT   2   /* a block of exactly the size, else first fit */
+#define MM_ADDR_FIT    3   /* first fit over address-ordered lists */
+#define MM_POLICY_NUM  4
+
+extern int mm_set_policy(int policy);
+
+/* Coalescing modes, for allocators that support mm_set_coalesce */
+#define MM_EAGER       0   /* merge each block with its neighbours on free */
+#define MM_DEFERRED    1   /* hold small blocks, merge when a fit misses */
+#define MM_COALESCE_NUM 2
+
+extern int mm_set_coalesce(int mode);
+
+/*
+ * Counters since the last mm_init, for allocators that support mm_stats.
+ * Class i holds blocks of up to class_limit[i] bytes, header included.
+ */
+#define MM_STATS_CLASSES 32
+
+struct mm_stats {
+    int classes;                                 /* Classes in use */
+    size_t class_limit[MM_STATS_CLASSES];
+    unsigned long mallocs[MM_STATS_CLASSES];
+    unsigned long frees[MM_STATS_CLASSES];
+    unsigned long free_blocks[MM_STATS_CLASSES]; /* Now on the free lists */
+    size_t free_bytes[MM_STATS_CLASSES];
+    unsigned long splits;                        /* Free blocks split */
+    unsigned long coalesces[4];                  /* By coalesce() case 1-4 */
+    unsigned long extends;                       /* Heap extensions */
+    size_t extend_bytes;
+    unsigned long realloc_inplace;               /* Resized without a copy */
+    unsigned long realloc_copy;
+};
+
+extern int mm_stats(struct mm_stats *stats);
+
+/* CSV heap snapshot, for allocators that support mm_dump; returns the
+ * number of blocks whose free list membership is inconsistent */
+extern int mm_dump(FILE *fp);
+
+/* Nonzero if the allocator may be called from several threads at once,
+ * for allocators that support mm_thread_safe */
+extern int mm_thread_safe(void);
+
+/* Payload bytes usable in a block, and hooks for pthread_atfork that
+ * hold the allocator's locks across fork(); for allocators that support
+ * them */
+extern size_t mm_usable_size(void *ptr);
+extern void mm_fork_prepare(void);
+extern void mm_fork_release(void);
+
 /* This is largely for debugging. */
 extern void mm_checkheap(int lineno);
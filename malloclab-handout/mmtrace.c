@@ -0,0 +1,597 @@
+/*
+ * mmtrace.c - Record the malloc traffic of a running program as a trace
+ *
+ * Preloaded, libmmtrace.so wraps malloc, free, realloc and calloc around
+ * glibc's __libc_* entry points; memalign, posix_memalign and
+ * aligned_alloc are recorded as mallocs so that their frees match. A
+ * call appends one raw record to a buffer owned by the calling thread,
+ * stamped from a global atomic counter: frees take their stamp before
+ * the block is released and allocations after it is returned, so a
+ * block handed from one thread to another is always freed before it is
+ * allocated again. realloc does both, with a RELEASE record of the old
+ * block before the call and a REALLOC record of the result after it,
+ * which conversion joins into one request. Full buffers are pushed on a lock-free stack that a
+ * writer thread drains to a scratch file, so the program never waits on
+ * a lock or on I/O.
+ *
+ * At exit the records are put back in stamp order, pointers are mapped
+ * to dense block ids, and the trace is written as a .rep file for
+ * mdriver -f, or in the binary format of trace.h if MMTRACE_BIN is set.
+ * Frees of blocks allocated before the capture started are dropped, and
+ * a realloc of such a block becomes a malloc. Calls made after exit
+ * begins, and all calls in forked children, are not recorded. Programs
+ * that the command runs are traced too, so for those a %p in MMTRACE
+ * stands for the process id; it defaults to mmtrace.%p.rep.
+ *
+ * usage: MMTRACE=<out.rep> LD_PRELOAD=./libmmtrace.so <command>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+#define BUF_RECS 4096   /* Records per thread buffer */
+#define DRAIN_US 1000   /* Writer sleep when no buffer is full */
+#define STOP_WAIT 1000  /* DRAIN_US waits at exit for a thread in record */
+
+/* The first half of a realloc: the block passed to it, before the call */
+#define RELEASE (FREE_BATCH + 1)
+
+/* One call as recorded: type is ALLOC, FREE, RELEASE or REALLOC */
+typedef struct {
+    uint64_t stamp;
+    uint64_t ptr;       /* block returned, or freed */
+    uint64_t from;      /* REALLOC: stamp of its RELEASE */
+    uint64_t size;
+    uint32_t type;
+    uint32_t pad;
+} rec_t;
+
+typedef struct buf {
+    struct buf *next;   /* on full_bufs */
+    int n;
+    rec_t recs[BUF_RECS];
+} buf_t;
+
+/* The buffer a thread is filling; never freed, so exit can flush it */
+typedef struct slot {
+    struct slot *next;
+    buf_t *cur;
+    int busy;           /* Inside record, which exit waits out */
+} slot_t;
+
+static __thread slot_t *my_slot;
+static slot_t *slots;           /* Every thread's slot */
+static buf_t *full_bufs;        /* Waiting for the writer */
+static uint64_t next_stamp;
+static volatile int enabled;
+static volatile int writer_stop;
+static pthread_t writer;
+static int raw_fd = -1;
+static char out_name[PATH_MAX];
+static char raw_name[PATH_MAX + 32];
+
+/* Pointer to block id map for the conversion: linear probing */
+typedef struct {
+    uint64_t key;       /* 0 if empty */
+    int id;
+} ent_t;
+
+static ent_t *tab;
+static int tab_bits;
+static size_t tab_live;
+
+/*
+ * Recording
+ */
+static uint64_t stamp(void)
+{
+    return __atomic_fetch_add(&next_stamp, 1, __ATOMIC_SEQ_CST);
+}
+
+static void *page_alloc(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+static void push_full(buf_t *b)
+{
+    b->next = __atomic_load_n(&full_bufs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&full_bufs, &b->next, b, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+static int64_t append(slot_t *s, uint32_t type, void *ptr, uint64_t from,
+                      size_t size)
+{
+    buf_t *b;
+    rec_t *r;
+    uint64_t t;
+
+    if ((b = s->cur) == NULL && (b = s->cur = page_alloc(sizeof(buf_t))) == NULL)
+        return -1;
+    r = &b->recs[b->n];
+    r->stamp = t = stamp();
+    r->ptr = (uintptr_t)ptr;
+    r->from = from;
+    r->size = size;
+    r->type = type;
+    if (++b->n == BUF_RECS) {
+        push_full(b);
+        s->cur = page_alloc(sizeof(buf_t));    /* b is the writer's now */
+    }
+    return t;
+}
+
+/*
+ * record - Append a call to this thread's buffer. The slot is marked
+ *          busy before enabled is checked again, so once mmtrace_stop
+ *          has cleared enabled and seen the slot idle, the buffer is
+ *          no longer touched. The stamp is taken here too, so a call
+ *          that finds recording stopped leaves no gap in the stamps.
+ *          Returns the stamp, or -1 if nothing was recorded.
+ */
+static int64_t record(uint32_t type, void *ptr, uint64_t from, size_t size)
+{
+    slot_t *s = my_slot;
+    int64_t t = -1;
+
+    if (s == NULL) {
+        if ((s = page_alloc(sizeof(slot_t))) == NULL)
+            return -1;
+        s->cur = page_alloc(sizeof(buf_t));
+        s->next = __atomic_load_n(&slots, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&slots, &s->next, s, 1,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+        my_slot = s;
+    }
+    __atomic_add_fetch(&s->busy, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&enabled, __ATOMIC_SEQ_CST))
+        t = append(s, type, ptr, from, size);
+    __atomic_sub_fetch(&s->busy, 1, __ATOMIC_RELEASE);
+    return t;
+}
+
+/*
+ * Wrappers
+ */
+void *malloc(size_t size)
+{
+    void *p = __libc_malloc(size);
+
+    if (enabled && p != NULL)
+        record(ALLOC, p, 0, size);
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (enabled && ptr != NULL)
+        record(FREE, ptr, 0, 0);
+    __libc_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p = __libc_calloc(nmemb, size);
+
+    if (enabled && p != NULL)
+        record(ALLOC, p, 0, nmemb * size);
+    return p;
+}
+
+/*
+ * realloc(ptr, 0) frees ptr and returns NULL. Otherwise the old block
+ * is released before the call, like a free, and the REALLOC after it
+ * names that RELEASE; a failed realloc has size 0, leaving ptr live.
+ */
+void *realloc(void *ptr, size_t size)
+{
+    int64_t t = -1;
+    void *p;
+
+    if (enabled && ptr != NULL)
+        t = record(size == 0 ? FREE : RELEASE, ptr, 0, 0);
+    p = __libc_realloc(ptr, size);
+    if (!enabled)
+        return p;
+    if (ptr == NULL) {
+        if (p != NULL)
+            record(ALLOC, p, 0, size);
+    } else if (t >= 0 && size != 0)
+        record(REALLOC, p != NULL ? p : ptr, t, p != NULL ? size : 0);
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    void *p = __libc_memalign(alignment, size);
+
+    if (enabled && p != NULL)
+        record(ALLOC, p, 0, size);
+    return p;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+        alignment % sizeof(void *) != 0)
+        return EINVAL;
+    if ((p = memalign(alignment, size)) == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+/*
+ * Writer thread
+ */
+static void write_buf(buf_t *b)
+{
+    const char *p = (const char *)b->recs;
+    size_t left = b->n * sizeof(rec_t);
+    ssize_t k;
+
+    while (left > 0 && (k = write(raw_fd, p, left)) > 0) {
+        p += k;
+        left -= k;
+    }
+    munmap(b, sizeof(buf_t));
+}
+
+static void drain(void)
+{
+    buf_t *b = __atomic_exchange_n(&full_bufs, NULL, __ATOMIC_ACQUIRE);
+    buf_t *next;
+
+    for (; b != NULL; b = next) {
+        next = b->next;
+        write_buf(b);
+    }
+}
+
+static void *writer_main(void *arg)
+{
+    (void)arg;
+    while (!writer_stop) {
+        if (__atomic_load_n(&full_bufs, __ATOMIC_RELAXED) == NULL)
+            usleep(DRAIN_US);
+        drain();
+    }
+    drain();
+    return NULL;
+}
+
+/*
+ * Conversion
+ */
+static size_t tab_slot(uint64_t key)
+{
+    return (key * 11400714819323198485ull) >> (64 - tab_bits);
+}
+
+static ent_t *tab_find(uint64_t key)
+{
+    size_t mask = ((size_t)1 << tab_bits) - 1;
+    size_t i;
+
+    for (i = tab_slot(key); tab[i].key != 0; i = (i + 1) & mask)
+        if (tab[i].key == key)
+            return &tab[i];
+    return NULL;
+}
+
+/* Returns 1 if key was already mapped, -1 if out of memory */
+static int tab_put(uint64_t key, int id)
+{
+    size_t mask, i;
+    ent_t *old = tab;
+    ent_t *e;
+
+    if ((e = tab_find(key)) != NULL) {
+        e->id = id;
+        return 1;
+    }
+    if (2 * (tab_live + 1) > ((size_t)1 << tab_bits)) {
+        size_t n = (size_t)1 << tab_bits;
+
+        if ((tab = calloc(n << 1, sizeof(ent_t))) == NULL) {
+            tab = old;
+            return -1;
+        }
+        tab_bits++;
+        mask = ((size_t)1 << tab_bits) - 1;
+        for (size_t j = 0; j < n; j++)
+            if (old[j].key != 0) {
+                for (i = tab_slot(old[j].key); tab[i].key != 0; i = (i + 1) & mask)
+                    ;
+                tab[i] = old[j];
+            }
+        free(old);
+    }
+    mask = ((size_t)1 << tab_bits) - 1;
+    for (i = tab_slot(key); tab[i].key != 0; i = (i + 1) & mask)
+        ;
+    tab[i].key = key;
+    tab[i].id = id;
+    tab_live++;
+    return 0;
+}
+
+/* Delete by shifting back the entries whose probe passed over e */
+static void tab_del(ent_t *e)
+{
+    size_t mask = ((size_t)1 << tab_bits) - 1;
+    size_t i = e - tab, j = i, home;
+
+    for (;;) {
+        j = (j + 1) & mask;
+        if (tab[j].key == 0)
+            break;
+        home = tab_slot(tab[j].key);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            tab[i] = tab[j];
+            i = j;
+        }
+    }
+    tab[i].key = 0;
+    tab_live--;
+}
+
+/* Runs from a destructor, so it reports and gives up rather than exit */
+static int fail(const char *name, const char *msg)
+{
+    fprintf(stderr, "mmtrace: %s: %s\n", name, msg);
+    return -1;
+}
+
+/*
+ * convert - Read the raw records back in stamp order and write the
+ *           trace; returns -1 on error
+ */
+static int convert(void)
+{
+    off_t len = lseek(raw_fd, 0, SEEK_END);
+    size_t nrec = len / sizeof(rec_t), nstamp = next_stamp, i;
+    rec_t *recs = NULL;
+    ssize_t *order;
+    traceop_t *ops;
+    int num_ids = 0, num_ops = 0;
+    unsigned long dropped = 0, clashes = 0, big = 0;
+    int k;
+    FILE *fp;
+
+    if (nrec > 0 && (recs = mmap(NULL, len, PROT_READ, MAP_PRIVATE, raw_fd,
+                                 0)) == MAP_FAILED)
+        return fail(raw_name, "cannot map the records");
+    if ((order = malloc((nstamp + 1) * sizeof(ssize_t))) == NULL ||
+        (ops = malloc((nrec + 1) * sizeof(traceop_t))) == NULL)
+        return fail(out_name, "out of memory");
+    for (i = 0; i < nstamp; i++)
+        order[i] = -1;
+    for (i = 0; i < nrec; i++)
+        if (recs[i].stamp < nstamp)
+            order[recs[i].stamp] = i;
+    tab_bits = 10;
+    if ((tab = calloc((size_t)1 << tab_bits, sizeof(ent_t))) == NULL)
+        return fail(out_name, "out of memory");
+
+    for (i = 0; i < nstamp; i++) {
+        rec_t *r;
+        ent_t *e;
+        traceop_t *op = &ops[num_ops];
+        int id = -1;
+
+        if (order[i] < 0)
+            continue;
+        r = &recs[order[i]];
+        op->batch = 0;
+        if (r->type == FREE || r->type == RELEASE) {
+            if ((e = tab_find(r->ptr)) != NULL) {
+                id = e->id;
+                tab_del(e);
+            }
+            /* Behind the loop, order[] holds the block id of a RELEASE
+             * for its REALLOC to pick up */
+            if (r->type == RELEASE) {
+                order[i] = id;
+                continue;
+            }
+            if (id < 0) {
+                dropped++;
+                continue;
+            }
+            op->type = FREE;
+            op->index = id;
+            op->size = 0;
+            num_ops++;
+            continue;
+        }
+        if (r->type == REALLOC) {
+            if (r->from < i)
+                id = order[r->from];
+            if (r->size == 0) {                 /* Failed: ptr stays live */
+                if (id >= 0 && tab_put(r->ptr, id) < 0)
+                    return fail(out_name, "out of memory");
+                continue;
+            }
+        }
+        /* mdriver sizes are 32 bits; a bigger block leaves the trace */
+        if (r->size > UINT32_MAX) {
+            big++;
+            if (id >= 0) {
+                op->type = FREE;
+                op->index = id;
+                op->size = 0;
+                num_ops++;
+            }
+            continue;
+        }
+        if (id >= 0) {
+            op->type = REALLOC;
+            op->index = id;
+        } else {
+            if (r->type == REALLOC)
+                dropped++;
+            op->type = ALLOC;
+            op->index = num_ids++;
+        }
+        /* mdriver takes NULL from malloc(0) for a failure */
+        op->size = r->size ? r->size : 1;
+        /* Frees are stamped before allocations can reuse their blocks,
+         * so a live pointer returned again means records were lost */
+        if ((k = tab_put(r->ptr, op->index)) < 0)
+            return fail(out_name, "out of memory");
+        clashes += k;
+        num_ops++;
+    }
+
+    if ((fp = fopen(out_name, "w")) == NULL)
+        return fail(out_name, strerror(errno));
+    if (getenv("MMTRACE_BIN") != NULL) {
+        tracehdr_t hdr;
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+        hdr.weight = 1;
+        hdr.num_ids = num_ids;
+        hdr.num_ops = num_ops;
+        hdr.op_size = sizeof(traceop_t);
+        if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            fwrite(ops, sizeof(traceop_t), num_ops, fp) != (size_t)num_ops) {
+            fclose(fp);
+            return fail(out_name, "write failed");
+        }
+    } else {
+        fprintf(fp, "1\n%d\n%d\n0\n", num_ids, num_ops);
+        for (k = 0; k < num_ops; k++)
+            if (ops[k].type == FREE)
+                fprintf(fp, "f %d\n", ops[k].index);
+            else
+                fprintf(fp, "%c %d %u\n", ops[k].type == ALLOC ? 'a' : 'r',
+                        ops[k].index, ops[k].size);
+    }
+    if (fclose(fp) != 0)
+        return fail(out_name, "write failed");
+
+    fprintf(stderr, "mmtrace: %s: %d ids, %d requests", out_name, num_ids,
+            num_ops);
+    if (dropped)
+        fprintf(stderr, ", %lu on blocks from before the capture", dropped);
+    if (big)
+        fprintf(stderr, ", %lu over 4 GB dropped", big);
+    if (clashes)
+        fprintf(stderr, ", %lu pointers returned while live", clashes);
+    if (nrec < nstamp)
+        fprintf(stderr, ", %lu lost", (unsigned long)(nstamp - nrec));
+    fprintf(stderr, "\n");
+    if (recs != NULL)
+        munmap(recs, len);
+    free(order);
+    free(ops);
+    free(tab);
+    return 0;
+}
+
+/*
+ * Start and exit
+ */
+static void fork_child(void)
+{
+    enabled = 0;
+    raw_fd = -1;
+}
+
+__attribute__((constructor))
+static void mmtrace_start(void)
+{
+    const char *out = getenv("MMTRACE");
+    const char *p;
+    size_t n = 0;
+
+    if (out == NULL)
+        out = "mmtrace.%p.rep";
+    for (p = out; *p != '\0' && n < sizeof(out_name) - 1; p++)
+        if (p[0] == '%' && p[1] == 'p') {
+            n += snprintf(out_name + n, sizeof(out_name) - n, "%d",
+                          (int)getpid());
+            p++;
+        } else
+            out_name[n++] = *p;
+    if (n >= sizeof(out_name))
+        n = sizeof(out_name) - 1;
+    out_name[n] = '\0';
+    snprintf(raw_name, sizeof(raw_name), "%s.%d.raw", out_name, (int)getpid());
+    if ((raw_fd = open(raw_name, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+        perror(raw_name);
+        return;
+    }
+    pthread_atfork(NULL, NULL, fork_child);
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        fprintf(stderr, "mmtrace: cannot start the writer thread\n");
+        close(raw_fd);
+        unlink(raw_name);
+        raw_fd = -1;
+        return;
+    }
+    enabled = 1;
+}
+
+/*
+ * mmtrace_stop - Other threads still run at exit, so wait for those
+ *                inside record before taking their buffers. A thread
+ *                that stays busy past STOP_WAIT, or the exiting thread
+ *                if exit interrupted its own record, keeps its buffer,
+ *                and its records are reported as lost.
+ */
+__attribute__((destructor))
+static void mmtrace_stop(void)
+{
+    slot_t *s;
+    buf_t *b;
+    int w;
+
+    if (!enabled)
+        return;
+    __atomic_store_n(&enabled, 0, __ATOMIC_SEQ_CST);
+    for (s = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); s != NULL; s = s->next) {
+        for (w = 0; s != my_slot && w < STOP_WAIT &&
+                    __atomic_load_n(&s->busy, __ATOMIC_SEQ_CST); w++)
+            usleep(DRAIN_US);
+        if (__atomic_load_n(&s->busy, __ATOMIC_ACQUIRE) == 0 &&
+            (b = __atomic_exchange_n(&s->cur, NULL, __ATOMIC_ACQ_REL)) != NULL)
+            push_full(b);
+    }
+    writer_stop = 1;
+    pthread_join(writer, NULL);
+    drain();                        /* Anything pushed after its last look */
+    convert();
+    close(raw_fd);
+    unlink(raw_name);
+}
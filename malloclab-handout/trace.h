@@ -0,0 +1,46 @@
+/*
+ * trace.h - Request records shared by mdriver and the trace tools
+ *
+ * A binary trace is a tracehdr_t followed by num_ops traceop_t records,
+ * all in host byte order, so mdriver can map the file and replay the
+ * records in place. traceconv writes one from a text .rep file.
+ */
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <stdint.h>
+
+/* First bytes of a binary trace */
+#define TRACE_MAGIC     "MMTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+/*
+ * Request types. A batch is n ALLOC_BATCH records of one size, or n
+ * FREE_BATCH records, that mdriver issues as one mm_malloc_batch or
+ * mm_free_batch call. Its first record holds n in batch, so batches that
+ * follow each other stay apart. In a .rep file it is a single
+ * "A <id> <n> <size>" or "F <id> <n>" line covering ids id to id+n-1,
+ * which counts as n requests in the header.
+ */
+enum { ALLOC, FREE, REALLOC, ALLOC_BATCH, FREE_BATCH };
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    uint32_t type;      /* ALLOC, FREE, REALLOC, ALLOC_BATCH or FREE_BATCH */
+    int32_t index;      /* index for free() to use later, -1 frees NULL */
+    uint32_t size;      /* byte size of alloc/realloc request */
+    uint32_t batch;     /* length of the batch this record starts, else 0 */
+} traceop_t;
+
+/* Header of a binary trace, the same fields as a .rep header */
+typedef struct {
+    char magic[TRACE_MAGIC_LEN];
+    int32_t weight;
+    int32_t num_ids;    /* number of alloc/realloc ids */
+    int32_t num_ops;    /* number of records that follow */
+    int32_t ignore_ranges;
+    uint32_t op_size;   /* sizeof(traceop_t) when written */
+    uint32_t reserved;
+} tracehdr_t;
+
+#endif /* __TRACE_H_ */
@@ -0,0 +1,112 @@
+/*
+ * traceconv.c - Convert a text .rep trace into the binary trace format
+ *
+ * The binary file, described in trace.h, holds the .rep header fields
+ * followed by one fixed-width record per request. mdriver -f accepts
+ * either format and maps binary traces instead of parsing them.
+ *
+ * usage: traceconv <in.rep> <out>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static void die(const char *name, const char *msg)
+{
+    fprintf(stderr, "traceconv: %s: %s\n", name, msg);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    tracehdr_t hdr;
+    traceop_t op;
+    char type;
+    int weight, num_ids, num_ops, ignore_ranges, i, k;
+    int index, max_index = -1, n;
+    unsigned int size = 0;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: traceconv <in.rep> <out>\n");
+        exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL) {
+        perror(argv[1]);
+        exit(1);
+    }
+    if (fscanf(in, "%d %d %d %d", &weight, &num_ids, &num_ops,
+               &ignore_ranges) != 4 || num_ids < 0 || num_ops < 0)
+        die(argv[1], "bad header");
+    if ((out = fopen(argv[2], "wb")) == NULL) {
+        perror(argv[2]);
+        exit(1);
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+    hdr.weight = weight;
+    hdr.num_ids = num_ids;
+    hdr.num_ops = num_ops;
+    hdr.ignore_ranges = ignore_ranges;
+    hdr.op_size = sizeof(traceop_t);
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+        die(argv[2], "write failed");
+
+    for (i = 0; i < num_ops; i++) {
+        if (fscanf(in, " %c %d", &type, &index) != 2)
+            die(argv[1], "fewer requests than the header says");
+        switch (type) {
+        case 'a':
+            op.type = ALLOC;
+            break;
+        case 'r':
+            op.type = REALLOC;
+            break;
+        case 'f':
+            op.type = FREE;
+            break;
+        case 'A':
+            op.type = ALLOC_BATCH;
+            break;
+        case 'F':
+            op.type = FREE_BATCH;
+            break;
+        default:
+            die(argv[1], "bogus request type");
+        }
+        /* Like mdriver, a request without a size repeats the last one */
+        if (op.type == ALLOC || op.type == REALLOC)
+            fscanf(in, "%u", &size);
+        n = 1;
+        if (op.type == ALLOC_BATCH || op.type == FREE_BATCH) {
+            if (fscanf(in, "%d", &n) != 1 || n < 1 || n > num_ops - i)
+                die(argv[1], "bad batch length");
+            if (op.type == ALLOC_BATCH)
+                fscanf(in, "%u", &size);
+        }
+        if (index + n > num_ids || (index < 0 && op.type != FREE))
+            die(argv[1], "index out of range");
+        if (index + n - 1 > max_index)
+            max_index = index + n - 1;
+        op.size = (op.type == FREE || op.type == FREE_BATCH) ? 0 : size;
+        /* A batch line is n records, one per id, the first holding n */
+        for (k = 0; k < n; k++) {
+            op.index = index + k;
+            op.batch = (k == 0 && (op.type == ALLOC_BATCH ||
+                                   op.type == FREE_BATCH)) ? n : 0;
+            if (fwrite(&op, sizeof(op), 1, out) != 1)
+                die(argv[2], "write failed");
+        }
+        i += n - 1;
+    }
+    if (max_index != num_ids - 1)
+        die(argv[1], "ids do not match the header");
+
+    fclose(in);
+    if (fclose(out) != 0)
+        die(argv[2], "write failed");
+    return 0;
+}
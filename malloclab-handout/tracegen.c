@@ -0,0 +1,507 @@
+/*
+ * tracegen.c - Generate synthetic traces with chosen size and lifetime
+ *              distributions
+ *
+ * The workload is a mix of components, each drawing block sizes from one
+ * distribution and lifetimes, counted in later allocations, from another.
+ * Blocks are freed when their lifetime ends, or soonest-to-die first
+ * while the live bytes are above a target, and live blocks are randomly
+ * grown by realloc. With -B, some allocations are batches of blocks of
+ * one size that share a lifetime and are freed as a batch. The same seed
+ * always gives the same trace. Output is a .rep file, or with -b the
+ * binary format of trace.h.
+ *
+ * usage: tracegen [-b] [-k] [-n <ops>] [-s <seed>] [-m <max>] [-L <bytes>]
+ *                 [-r <prob>:mul:<f> | -r <prob>:add:<bytes>] [-l <life>]
+ *                 [-B <prob>:<n>] [-o <file>] -S [<weight>@]<size>[/<life>] ...
+ *
+ * Size distributions, in bytes:
+ *     fixed:<n>                 always n
+ *     uniform:<lo>:<hi>         uniform in [lo, hi]
+ *     lognormal:<median>:<sigma> median * e^(sigma * N(0,1))
+ *     hist:<file>               "<size> <weight>" lines of an empirical mix
+ * Lifetime distributions, in allocations, also take:
+ *     exp:<mean>                exponential with the given mean
+ *     forever                   freed only at the end, or by -L
+ *
+ * For example, mostly short-lived 32-128 byte messages with a few 64 KB
+ * buffers and a long-lived cache of 256 byte entries:
+ *
+ *     tracegen -n 200000 -s 1 -S 90@uniform:32:128/exp:400 \
+ *              -S 2@fixed:65536/exp:20 -S 8@fixed:256/forever -L 8000000
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MAXLINE  1024
+#define MAXCOMP  16          /* -S components */
+#define FOREVER  UINT64_MAX  /* Death time of blocks that live to the end */
+
+/* Distribution kinds */
+enum { D_FIXED, D_UNIFORM, D_LOGNORMAL, D_EXP, D_FOREVER, D_HIST };
+
+typedef struct {
+    int kind;
+    double a, b;             /* Parameters, as in the usage above */
+    int n;                   /* hist: number of sizes... */
+    double *size;            /* ... each size... */
+    double *cum;             /* ... and the running sum of the weights */
+} dist_t;
+
+/* One part of the workload mix */
+typedef struct {
+    double weight;
+    dist_t size;
+    dist_t life;
+    int has_life;            /* Else the -l lifetime applies */
+} comp_t;
+
+/* A live block, or batch of blocks, in the death-time heap */
+typedef struct {
+    uint64_t death;
+    int id;
+    int n;                   /* A batch holds ids id to id+n-1 */
+} death_t;
+
+static uint64_t rng_state;
+
+/* Generator state */
+static traceop_t *ops;       /* Requests so far */
+static int num_ops, max_ops;
+static size_t *id_size;      /* Payload size of each live id */
+static int *id_slot;         /* Position of each live id in live_ids */
+static int *live_ids, num_live;
+static int *free_ids, num_free_ids;
+static int num_ids, max_ids;
+static death_t *deaths;      /* Min-heap of live blocks by death time */
+static int num_deaths;
+static size_t live_bytes;
+
+static void die(const char *what, const char *msg)
+{
+    fprintf(stderr, "tracegen: %s: %s\n", what, msg);
+    exit(1);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL)
+        die("realloc", "out of memory");
+    return p;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: tracegen [-bk] [-n <ops>] [-s <seed>] [-m <max>] [-L <bytes>]\n"
+            "                [-r <prob>:mul:<f> | -r <prob>:add:<bytes>] [-l <life>]\n"
+            "                [-B <prob>:<n>] [-o <file>] -S [<weight>@]<size>[/<life>] ...\n");
+    fprintf(stderr, "\t-S <spec>   Add a component: sizes from <size>, lifetimes from <life>.\n");
+    fprintf(stderr, "\t-l <life>   Lifetime of components without one (default exp:100).\n");
+    fprintf(stderr, "\t-n <ops>    Requests before the final frees (default 100000).\n");
+    fprintf(stderr, "\t-s <seed>   Random seed (default 1).\n");
+    fprintf(stderr, "\t-m <max>    Largest block size (default 1048576).\n");
+    fprintf(stderr, "\t-L <bytes>  Free the soonest-to-die blocks while more bytes are live.\n");
+    fprintf(stderr, "\t-r <spec>   Grow a random live block with probability <prob>.\n");
+    fprintf(stderr, "\t-B <spec>   Allocate a batch of <n> blocks with probability <prob>.\n");
+    fprintf(stderr, "\t-k          Keep the blocks live at the end instead of freeing them.\n");
+    fprintf(stderr, "\t-b          Write the binary trace format.\n");
+    fprintf(stderr, "\t-o <file>   Write to <file> instead of stdout.\n");
+}
+
+/*
+ * rng - splitmix64, so traces do not depend on the libc rand()
+ */
+static uint64_t rng(void)
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1) */
+static double rng_unit(void)
+{
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Standard normal, by Box-Muller */
+static double rng_normal(void)
+{
+    double u = 1.0 - rng_unit();
+
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * rng_unit());
+}
+
+/*
+ * read_hist - Read the "<size> <weight>" lines of an empirical histogram
+ */
+static void read_hist(dist_t *d, const char *name)
+{
+    char line[MAXLINE];
+    double size, weight, sum = 0;
+    FILE *fp;
+
+    if ((fp = fopen(name, "r")) == NULL)
+        die(name, "cannot open");
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%lf %lf", &size, &weight) != 2)
+            continue;
+        if (size < 0 || weight < 0)
+            die(name, "negative size or weight");
+        d->size = xrealloc(d->size, (d->n + 1) * sizeof(double));
+        d->cum = xrealloc(d->cum, (d->n + 1) * sizeof(double));
+        sum += weight;
+        d->size[d->n] = size;
+        d->cum[d->n++] = sum;
+    }
+    fclose(fp);
+    if (sum <= 0)
+        die(name, "no weighted sizes");
+}
+
+/*
+ * parse_dist - Parse a distribution spec; lifetimes also accept exp and
+ *              forever
+ */
+static void parse_dist(dist_t *d, const char *spec, int life)
+{
+    memset(d, 0, sizeof(*d));
+    if (sscanf(spec, "fixed:%lf", &d->a) == 1) {
+        d->kind = D_FIXED;
+    } else if (sscanf(spec, "uniform:%lf:%lf", &d->a, &d->b) == 2) {
+        d->kind = D_UNIFORM;
+        if (d->b < d->a)
+            die(spec, "empty range");
+    } else if (sscanf(spec, "lognormal:%lf:%lf", &d->a, &d->b) == 2) {
+        d->kind = D_LOGNORMAL;
+    } else if (strncmp(spec, "hist:", 5) == 0) {
+        d->kind = D_HIST;
+        read_hist(d, spec + 5);
+    } else if (life && sscanf(spec, "exp:%lf", &d->a) == 1) {
+        d->kind = D_EXP;
+    } else if (life && strcmp(spec, "forever") == 0) {
+        d->kind = D_FOREVER;
+    } else {
+        die(spec, "unknown distribution");
+    }
+    if (d->a < 0 || d->b < 0)
+        die(spec, "negative parameter");
+}
+
+/*
+ * sample - Draw a value from d
+ */
+static double sample(const dist_t *d)
+{
+    double u;
+    int lo, hi, mid;
+
+    switch (d->kind) {
+    case D_FIXED:
+        return d->a;
+    case D_UNIFORM:
+        return d->a + floor(rng_unit() * (d->b - d->a + 1));
+    case D_LOGNORMAL:
+        return d->a * exp(d->b * rng_normal());
+    case D_EXP:
+        return -d->a * log(1.0 - rng_unit());
+    case D_HIST:
+        u = rng_unit() * d->cum[d->n - 1];
+        for (lo = 0, hi = d->n - 1; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (d->cum[mid] > u)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return d->size[lo];
+    default:
+        return 0;
+    }
+}
+
+/*
+ * emit - Append a request
+ */
+static void emit(int type, int id, size_t size)
+{
+    if (num_ops == max_ops) {
+        max_ops = max_ops ? 2 * max_ops : 4096;
+        ops = xrealloc(ops, max_ops * sizeof(traceop_t));
+    }
+    ops[num_ops].type = type;
+    ops[num_ops].index = id;
+    ops[num_ops].size = (type == FREE || type == FREE_BATCH) ? 0 : size;
+    ops[num_ops].batch = 0;
+    num_ops++;
+}
+
+/*
+ * death_push, death_pop - The min-heap of live blocks by death time
+ */
+static void death_push(uint64_t death, int id, int n)
+{
+    int i, parent;
+
+    deaths = xrealloc(deaths, (num_deaths + 1) * sizeof(death_t));
+    for (i = num_deaths++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (deaths[parent].death <= death)
+            break;
+        deaths[i] = deaths[parent];
+    }
+    deaths[i].death = death;
+    deaths[i].id = id;
+    deaths[i].n = n;
+}
+
+static death_t death_pop(void)
+{
+    death_t last = deaths[--num_deaths], top = deaths[0];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < num_deaths) {
+        if (child + 1 < num_deaths && deaths[child + 1].death < deaths[child].death)
+            child++;
+        if (last.death <= deaths[child].death)
+            break;
+        deaths[i] = deaths[child];
+        i = child;
+    }
+    deaths[i] = last;
+    return top;
+}
+
+/*
+ * block_alloc, block_free - Take and give back an id, keeping the live
+ *                           set that realloc picks from. The ids of a
+ *                           batch are new, so that they are consecutive.
+ */
+static int block_alloc(size_t size, int type)
+{
+    int id;
+
+    if (num_free_ids > 0 && type == ALLOC) {
+        id = free_ids[--num_free_ids];
+    } else {
+        if (num_ids == max_ids) {
+            max_ids = max_ids ? 2 * max_ids : 1024;
+            id_size = xrealloc(id_size, max_ids * sizeof(size_t));
+            id_slot = xrealloc(id_slot, max_ids * sizeof(int));
+            live_ids = xrealloc(live_ids, max_ids * sizeof(int));
+            free_ids = xrealloc(free_ids, max_ids * sizeof(int));
+        }
+        id = num_ids++;
+    }
+    id_size[id] = size;
+    id_slot[id] = num_live;
+    live_ids[num_live++] = id;
+    live_bytes += size;
+    emit(type, id, size);
+    return id;
+}
+
+static void block_free(int id, int type)
+{
+    int last = live_ids[--num_live];
+
+    live_ids[id_slot[id]] = last;
+    id_slot[last] = id_slot[id];
+    live_bytes -= id_size[id];
+    free_ids[num_free_ids++] = id;
+    emit(type, id, 0);
+}
+
+/*
+ * death_free - Free the block or batch whose lifetime is up
+ */
+static void death_free(death_t d)
+{
+    int i, first = num_ops;
+
+    for (i = 0; i < d.n; i++)
+        block_free(d.id + i, (d.n > 1) ? FREE_BATCH : FREE);
+    if (d.n > 1)
+        ops[first].batch = d.n;
+}
+
+/*
+ * write_trace - Write the requests as a .rep file or a binary trace
+ */
+static void write_trace(FILE *fp, const char *name, int binary)
+{
+    tracehdr_t hdr;
+    int i, n;
+
+    if (binary) {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+        hdr.weight = 1;
+        hdr.num_ids = num_ids;
+        hdr.num_ops = num_ops;
+        hdr.op_size = sizeof(traceop_t);
+        if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+            || fwrite(ops, sizeof(traceop_t), num_ops, fp) != (size_t)num_ops)
+            die(name, "write failed");
+        return;
+    }
+    fprintf(fp, "1\n%d\n%d\n0\n", num_ids, num_ops);
+    for (i = 0; i < num_ops; i += n) {
+        /* A batch line covers the records of one batch, whose ids are
+           consecutive */
+        n = (ops[i].type == ALLOC_BATCH || ops[i].type == FREE_BATCH)
+            ? (int)ops[i].batch : 1;
+        switch (ops[i].type) {
+        case FREE:
+            fprintf(fp, "f %d\n", ops[i].index);
+            break;
+        case ALLOC_BATCH:
+            fprintf(fp, "A %d %d %u\n", ops[i].index, n, ops[i].size);
+            break;
+        case FREE_BATCH:
+            fprintf(fp, "F %d %d\n", ops[i].index, n);
+            break;
+        default:
+            fprintf(fp, "%c %d %u\n", ops[i].type == ALLOC ? 'a' : 'r',
+                    ops[i].index, ops[i].size);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    comp_t comps[MAXCOMP];
+    dist_t life;
+    char spec[MAXLINE], *at, *slash, *out = NULL;
+    char grow_kind[8] = "";
+    int c, i, num_comps = 0, binary = 0, keep = 0, id, batch = 1, n, k;
+    long nreq = 100000;
+    double total = 0, u, grow_prob = 0, grow_arg = 0, batch_prob = 0, v;
+    size_t max_size = 1 << 20, live_target = 0, size;
+    uint64_t now = 0, seed = 1;
+    FILE *fp = stdout;
+
+    parse_dist(&life, "exp:100", 1);
+    while ((c = getopt(argc, argv, "S:l:n:s:m:L:r:B:kbo:h")) != EOF) {
+        switch (c) {
+        case 'S':
+            if (num_comps == MAXCOMP)
+                die(optarg, "too many components");
+            snprintf(spec, MAXLINE, "%s", optarg);
+            comp_t *cp = &comps[num_comps++];
+            cp->weight = 1;
+            at = spec;
+            if (strchr(spec, '@') != NULL) {
+                cp->weight = atof(spec);
+                at = strchr(spec, '@') + 1;
+            }
+            if ((cp->has_life = ((slash = strchr(at, '/')) != NULL))) {
+                *slash = '\0';
+                parse_dist(&cp->life, slash + 1, 1);
+            }
+            parse_dist(&cp->size, at, 0);
+            if (cp->weight <= 0)
+                die(optarg, "weight must be positive");
+            total += cp->weight;
+            break;
+        case 'l':
+            parse_dist(&life, optarg, 1);
+            break;
+        case 'n':
+            nreq = atol(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            max_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'L':
+            live_target = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%lf:%7[a-z]:%lf", &grow_prob, grow_kind, &grow_arg) != 3
+                || (strcmp(grow_kind, "mul") != 0 && strcmp(grow_kind, "add") != 0))
+                die(optarg, "expected <prob>:mul:<factor> or <prob>:add:<bytes>");
+            break;
+        case 'B':
+            if (sscanf(optarg, "%lf:%d", &batch_prob, &batch) != 2 || batch < 2)
+                die(optarg, "expected <prob>:<n> with n > 1");
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'b':
+            binary = 1;
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (num_comps == 0 || optind != argc || max_size == 0 || max_size > UINT32_MAX) {
+        usage();
+        exit(1);
+    }
+    rng_state = seed;
+
+    while (num_ops < nreq) {
+        /* Free the blocks whose time is up, then any above the live target */
+        while (num_deaths > 0 && deaths[0].death <= now)
+            death_free(death_pop());
+        while (live_target && live_bytes > live_target && num_deaths > 0)
+            death_free(death_pop());
+        if (num_ops >= nreq)
+            break;
+
+        if (num_live > 0 && grow_prob > 0 && rng_unit() < grow_prob) {
+            id = live_ids[rng() % num_live];
+            v = (grow_kind[0] == 'm') ? id_size[id] * grow_arg : id_size[id] + grow_arg;
+            size = (v < 1) ? 1 : (v > max_size) ? max_size : (size_t)v;
+            live_bytes += size - id_size[id];
+            id_size[id] = size;
+            emit(REALLOC, id, size);
+            continue;
+        }
+
+        for (u = rng_unit() * total, i = 0; i < num_comps - 1; i++)
+            if ((u -= comps[i].weight) < 0)
+                break;
+        v = sample(&comps[i].size);
+        size = (v < 1) ? 1 : (v > max_size) ? max_size : (size_t)v;
+        n = (batch_prob > 0 && rng_unit() < batch_prob) ? batch : 1;
+        id = block_alloc(size, (n > 1) ? ALLOC_BATCH : ALLOC);
+        for (k = 1; k < n; k++)
+            block_alloc(size, ALLOC_BATCH);
+        if (n > 1)
+            ops[num_ops - n].batch = n;
+
+        dist_t *d = comps[i].has_life ? &comps[i].life : &life;
+        v = sample(d);
+        now++;
+        death_push((d->kind == D_FOREVER) ? FOREVER : now + (uint64_t)v, id, n);
+    }
+    while (!keep && num_deaths > 0)
+        death_free(death_pop());
+
+    if (out != NULL && (fp = fopen(out, binary ? "wb" : "w")) == NULL)
+        die(out, "cannot open");
+    write_trace(fp, out ? out : "stdout", binary);
+    if (fclose(fp) != 0)
+        die(out ? out : "stdout", "write failed");
+    return 0;
+}
@@ -10,6 +10,24 @@
 #include "mm.h"
 #include "memlib.h"
 
+/* do not change the following! */
+#ifdef DRIVER
+/* create aliases for driver tests */
+#define malloc mm_malloc
+#define free mm_free
+#define realloc mm_realloc
+#define calloc mm_calloc
+#endif /* def DRIVER */
+
+/*
+ * A build can set the switch below, and any parameter guarded by
+ * #ifndef, in a header of its own named by -DMM_CONFIG='"conf.h"', or
+ * one by one with -D; the rest keep their defaults
+ */
+#ifdef MM_CONFIG
+#include MM_CONFIG
+#endif
+
 /*
  * If NEXT_FIT defined use next fit search, else use first fit search
  */
@@ -19,10 +37,41 @@
 /* Basic constants and macros */
 #define WSIZE       4       /* Word and header/footer size (bytes) */ //line:vm:mm:beginconst
 #define DSIZE       8       /* Doubleword size (bytes) */
-#define CHUNKSIZE  (1<<9)+(1<<8)+(1<<7)  /* Extend heap by this amount (bytes) */  //line:vm:mm:endconst
+#ifndef CHUNKSIZE
+#define CHUNKSIZE  ((1<<9)+(1<<8)+(1<<7))  /* Extend heap by at least this amount (bytes) */  //line:vm:mm:endconst
+#endif
+
+/* Heap growth: a miss within GROW_WINDOW allocations of the last one
+ * doubles the extension, up to GROW_MAX and 1/GROW_FRAC of the heap */
+#ifndef GROW_WINDOW
+#define GROW_WINDOW 64
+#endif
+#ifndef GROW_MAX
+#define GROW_MAX    (1<<16)
+#endif
+#ifndef GROW_FRAC
+#define GROW_FRAC   16
+#endif
 
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))
+#define MIN(x, y) ((x) < (y)? (x) : (y))
+
+/* Bytes a block spends besides its payload: allocated blocks keep both
+ * a header and a footer */
+#define BLOCK_OVERHEAD  DSIZE
+
+/* Block size for a request: payload plus overhead, doubleword aligned,
+ * and at least the minimum block */
+#define ADJUST_SIZE(size)  ((size) <= 2*DSIZE - BLOCK_OVERHEAD ? 2*DSIZE : \
+                            DSIZE * (((size) + BLOCK_OVERHEAD + (DSIZE-1)) / DSIZE))
+
+/* Extra payload reserved when realloc has to move a growing block, so
+ * that its next growths can stay in place. None by default: with one
+ * first-fit list the slack costs more than the moves it saves. */
+#ifndef REALLOC_RESERVE
+#define REALLOC_RESERVE(size)  0
+#endif
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)  ((size) | (alloc)) //line:vm:mm:pack
@@ -51,6 +100,8 @@
 /* Global variables */
 static char *heap_listp = 0;   /* Pointer to first block */
 static char *free_listp = 0;   /* Pointer to header of free list */
+static size_t grow_chunk;      /* Current heap extension (bytes) */
+static unsigned int grow_ops;  /* Allocations since the last extension */
 
 
 #ifdef NEXT_FIT
@@ -59,11 +110,13 @@ static char *rover;           /* Next fit rover */
 
 /* Function prototypes for internal helper routines */
 static void *extend_heap(size_t words);
+static size_t grow_size(size_t asize);
 static void place(void *bp, size_t asize);
 static void *find_fit(size_t asize);
 static void *coalesce(void *bp);
 static void printblock(void *bp);
 static void checkblock(void *bp);
+static void *realloc_block(void *bp, size_t asize);
 
 /*
  * mm_init - Initialize the memory manager
@@ -91,6 +144,8 @@ int mm_init(void)
     /* $begin mminit */
     
     /* Extend the empty heap with a free block of CHUNKSIZE bytes */
+    grow_chunk = CHUNKSIZE;
+    grow_ops = 0;
     if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
         return -1;
     
@@ -118,10 +173,9 @@ void *mm_malloc(size_t size)
         return NULL;
     
     /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= DSIZE)                                          //line:vm:mm:sizeadjust1
-        asize = 2*DSIZE;                                        //line:vm:mm:sizeadjust2
-    else
-        asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE); //line:vm:mm:sizeadjust3
+    asize = ADJUST_SIZE(size);                                  //line:vm:mm:sizeadjust1
+    
+    grow_ops++;
     
     /* Search the free list for a fit */
     if ((bp = find_fit(asize)) != NULL) {  //line:vm:mm:findfitcall
@@ -130,7 +184,7 @@ void *mm_malloc(size_t size)
     }
     
     /* No fit found. Get more memory and place the block */
-    extendsize = MAX(asize,CHUNKSIZE);                 //line:vm:mm:growheap1
+    extendsize = grow_size(asize);                     //line:vm:mm:growheap1
     if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
         return NULL;                                  //line:vm:mm:growheap2
     place(bp, asize);
@@ -224,7 +278,7 @@ static void *coalesce(void *bp)
     }
     
     else if (prev_alloc && !next_alloc) {      /* Case 2 */
-        
+        freelist_delete(NEXT_BLKP(bp));
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
         PUT(HDRP(bp), PACK(size, 0));
         PUT(FTRP(bp), PACK(size,0));
@@ -264,48 +318,128 @@ static void *coalesce(void *bp)
 /* $end mmfree */
 
 /*
- * mm_realloc - Naive implementation of realloc
+ * mm_realloc - Resize a block in place when its neighbourhood allows,
+ *              falling back to malloc, copy and free
  */
 void *mm_realloc(void *ptr, size_t size)
 {
-    {
-        size_t oldsize;
-        void *newptr;
-        
-        /* If size == 0 then this is just free, and we return NULL. */
-        if(size == 0) {
-            mm_free(ptr);
-            return 0;
-        }
-        
-        /* If oldptr is NULL, then this is just malloc. */
-        if(ptr == NULL) {
-            return mm_malloc(size);
-        }
-        
+    size_t oldsize;
+    void *newptr;
+    
+    /* If size == 0 then this is just free, and we return NULL. */
+    if(size == 0) {
+        mm_free(ptr);
+        return 0;
+    }
+    
+    /* If oldptr is NULL, then this is just malloc. */
+    if(ptr == NULL) {
+        return mm_malloc(size);
+    }
+    
+    if ((newptr = realloc_block(ptr, ADJUST_SIZE(size))) != NULL)
+        return newptr;
+    
+    /* A block that had to move for growth tends to grow again */
+    oldsize = GET_SIZE(HDRP(ptr)) - DSIZE;
+    newptr = NULL;
+    if (size > oldsize && size + REALLOC_RESERVE(size) > size)
+        newptr = mm_malloc(size + REALLOC_RESERVE(size));
+    if (!newptr)
         newptr = mm_malloc(size);
+    
+    /* If realloc() fails the original block is left untouched  */
+    if(!newptr) {
+        return 0;
+    }
+    
+    /* Copy the old payload. */
+    memcpy(newptr, ptr, MIN(size, oldsize));
+    
+    /* Free the old block. */
+    mm_free(ptr);
+    
+    return newptr;
+}
+
+/*
+ * realloc_block - Resize block bp to asize bytes without moving it.
+ *                 A shrink splits off the tail; a growth absorbs the
+ *                 free successor, extending the heap first when bp or
+ *                 that successor is the last block. Returns NULL when
+ *                 the block has to move.
+ */
+static void *realloc_block(void *bp, size_t asize)
+{
+    size_t csize = GET_SIZE(HDRP(bp));
+    size_t nsize;
+    char *next;
+    
+    if (asize > csize) {
+        next = NEXT_BLKP(bp);
+        nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
         
-        /* If realloc() fails the original block is left untouched  */
-        if(!newptr) {
-            return 0;
+        /* Last block before the epilogue: grow the heap by the shortfall */
+        if (csize + nsize < asize &&
+            GET_SIZE(HDRP(nsize ? NEXT_BLKP(next) : next)) == 0) {
+            if (extend_heap(MAX(asize - csize - nsize, 2*DSIZE)/WSIZE) == NULL)
+                return NULL;
+            nsize = GET_SIZE(HDRP(next));
         }
+        if (csize + nsize < asize)
+            return NULL;
         
-        /* Copy the old data. */
-        oldsize = GET_SIZE(HDRP(ptr));
-        if(size < oldsize) oldsize = size;
-        memcpy(newptr, ptr, oldsize);
-        
-        /* Free the old block. */
-        mm_free(ptr);
-        
-        return newptr;
+        freelist_delete(next);
+#ifdef NEXT_FIT
+        if (rover == next)
+            rover = bp;
+#endif
+        csize += nsize;
+        PUT(HDRP(bp), PACK(csize, 1));
+        PUT(FTRP(bp), PACK(csize, 1));
     }
+    
+    /* Give back the tail if it can stand as a free block */
+    if (csize - asize >= 2*DSIZE) {
+        PUT(HDRP(bp), PACK(asize, 1));
+        PUT(FTRP(bp), PACK(asize, 1));
+        next = NEXT_BLKP(bp);
+        PUT(HDRP(next), PACK(csize-asize, 0));
+        PUT(FTRP(next), PACK(csize-asize, 0));
+        coalesce(next);
+    }
+    return bp;
 }
 
 /*
  * The remaining routines are internal helper routines
  */
 
+/*
+ * grow_size - Bytes to extend the heap by for a block of asize that no
+ *             free block fits. A free last block only needs the shortfall;
+ *             otherwise the extension doubles while misses come close
+ *             together and drops back to CHUNKSIZE when they are rare.
+ */
+static size_t grow_size(size_t asize)
+{
+    char *top = (char *)mem_heap_hi() + 1;
+    size_t last, cap;
+    
+    if (!GET_ALLOC(top - DSIZE)) {              /* Last block is free */
+        last = GET_SIZE(top - DSIZE);
+        return (asize > last + 2*DSIZE) ? asize - last : 2*DSIZE;
+    }
+    
+    cap = MIN(GROW_MAX, (size_t)(top - heap_listp) / GROW_FRAC);
+    if (grow_ops < GROW_WINDOW)
+        grow_chunk = MIN(2*grow_chunk, MAX(cap, CHUNKSIZE));
+    else
+        grow_chunk = CHUNKSIZE;
+    grow_ops = 0;
+    return MAX(asize, grow_chunk);
+}
+
 /*
  * extend_heap - Extend heap with free block and return its block pointer
  */
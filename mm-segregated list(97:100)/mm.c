@@ -10,34 +10,86 @@
  * 
  * Overview:
  * 1. Segregated free list of size LIST_NUM = 24.
- * 2. First-fit strategy for searching the free blocks.
- * 3. LIFO strategy for insertion into free list
+ * 2. First-fit strategy for searching the free blocks, or best fit
+ *    over BEST_FIT_K candidates, or exact size first (mm_set_policy).
+ * 3. LIFO strategy for insertion into free list, or address order for
+ *    lists of blocks above ADDR_MIN under MM_ADDR_FIT
  * 4. Store allocated status in the second bit of header in next block
  *    to save the size of footer for allocated block.
  * 5. Use offset in free list for finding next/prev free block
+ * 6. Constant-time size class lookup generated from LIST_LIMITS
+ * 7. Bitmap of non-empty free lists so searches skip empty lists
+ * 8. Optional per-thread cache of small blocks (THREAD_CACHE) in front
+ *    of the shared lists, which are then guarded by heap_lock
+ * 9. Optional arenas (ARENAS): ARENA_NUM independent heaps, each with
+ *    its own free lists and lock. Arena 0 is the mem_sbrk heap, the
+ *    others are ARENA_SIZE aligned regions from mem_map whose first
+ *    word points back to their arena.
+ * 10. Optional trimming (HEAP_TRIM): a large top free block shrinks the
+ *    heap, large interior free blocks have their pages released
+ * 11. Optional huge blocks (HUGE_MMAP): requests of MMAP_THRESHOLD bytes
+ *    or more get their own mapping, unmapped on free and grown by
+ *    mem_remap on realloc
+ * 12. Optional size tree (SIZE_TREE): free blocks above TREE_MIN live in
+ *    a red-black tree keyed by (size, address) whose root takes the
+ *    first large list entry, so large fits are best fit in O(log n)
+ * 13. Optional slab runs (SLAB): requests of up to SLAB_MAX bytes take a
+ *    headerless slot in a RUN_SIZE aligned run, an allocated block in
+ *    the heap; a page map tells runs from blocks on free
+ * 14. Optional deferred coalescing (DEFER_COALESCE): freed blocks up to
+ *    QUICK_MAX wait, still allocated, on exact-size quick lists and
+ *    are merged in one sweep when a fit search misses
+ * 15. Heap growth doubles while fit misses come close together, up to
+ *    GROW_MAX; a free last block is only extended by the shortfall
+ * 16. Optional control block (CTL_BLOCK): the bitmap and list entries
+ *    move off the heap base into a cache line aligned block, one per
+ *    arena, so list updates do not share lines with user blocks
+ * 17. Batches: mm_malloc_batch carves n equal blocks from one free
+ *    block or heap extension, and mm_free_batch sorts its pointers so
+ *    each run of neighbours is freed and coalesced as a single block
+ * 18. Regions: mm_region_alloc bumps a pointer through chunks that are
+ *    ordinary allocated blocks, and mm_region_reset frees all of its
+ *    blocks by handing back whole chunks, keeping the newest
+ * 19. mm_memalign returns the slack before an aligned payload to the
+ *    free lists, and mm_free_sized uses the known size to skip the slab
+ *    and huge block tests and, under THREAD_CACHE, the header read
+ * 20. calloc checks the product for overflow and only clears what may
+ *    be dirty: memory below the old heap top or mem_heap_clean
+ * 21. mm_usable_size and the mm_fork_prepare/mm_fork_release hooks let
+ *    libmm.so (handout libmm.c) stand in for libc malloc
+ * 22. Switches and tuning parameters can come from a header named by
+ *    MM_CONFIG; under FIXED_POLICY the fit policy and coalescing mode are
+ *    constants, so each configuration keeps only its own hot path
+ * 23. Under CHECK_HEAP every free checks the block's header and its
+ *    neighbour's, and each operation samples a free list and walks a few
+ *    blocks of the heap; mm_checkheap knows allocated blocks lack footers
  *
  *
- * Structure of heap:
- * Alignment padding [4 bytes]
- * Entry of free list[4 bytes * LIST_NUM]
- * Prologue          [4 bytes + 4 bytes]
+ * Structure of heap (words are 4 bytes, 8 bytes under WIDE_HEAP):
+ * Bitmap of lists   [1 word] (bit i set if free list i is non-empty)
+ * Entry of free list[1 word * LIST_NUM]
+ * Entry of quick list[1 word * QUICK_NUM] (DEFER_COALESCE only)
+ * Spare             [1 word] (if needed to make the entries even)
+ * Prologue          [1 word + 1 word]
+ * Under CTL_BLOCK the bitmap and entries are in struct ctl instead, and
+ * a 1 word pad keeps the prologue aligned.
  * Heap for allocation/free
- * Epilogue          [4 bytes]
+ * Epilogue          [1 word]
  *
- * "heap_listp" always points to prologue block(alignemnt to 8)
- * "free_listp" always points to the first free list (LIST1)
+ * "heap_listp" always points to prologue block(alignemnt to DSIZE)
+ * "free_listp" always points to the first free list (smallest class)
  *
  *
  * Structure of blocks:
- * 1. Free blocks(16 bytes)
+ * 1. Free blocks(16 bytes, 32 under WIDE_HEAP)
  *
- *    header   [4 bytes]
- *    next     [4 bytes] (offset)
- *    prev     [4 bytes] (offset)
- *    footer   [4 bytes] (offset)
+ *    header   [1 word]
+ *    next     [1 word] (offset)
+ *    prev     [1 word] (offset)
+ *    footer   [1 word] (offset)
  *
  * 2. Allocated blocks
- *    header   [4 bytes]
+ *    header   [1 word]
  *    payload
  *
  *
@@ -48,7 +100,7 @@
  * Bit 1: 0 for free state of prev block
  *        1 for allocated state of prev block
  *
- * Bit 2: 0
+ * Bit 2: 1 for a huge block in its own mapping (HUGE_MMAP), else 0
  *
  * Bit 3-31: size of current block
  *
@@ -59,57 +111,241 @@
  *
  *
  */
+#define _GNU_SOURCE                 /* sched_getcpu */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include "mm.h"
 #include "memlib.h"
 
+/* do not change the following! */
+#ifdef DRIVER
+/* create aliases for driver tests */
+#define malloc mm_malloc
+#define free mm_free
+#define realloc mm_realloc
+#define calloc mm_calloc
+#endif /* def DRIVER */
+
+/*
+ * A build can set any of the switches below, and any parameter guarded by
+ * #ifndef (size classes, thresholds, growth), in a header of its own named
+ * by -DMM_CONFIG='"conf.h"', or one by one with -D; the rest keep their
+ * defaults
+ */
+#ifdef MM_CONFIG
+#include MM_CONFIG
+#endif
+
 /*
- * If NEXT_FIT defined use next fit search, else use first fit search
+ * If NEXT_FIT defined use next fit search, else search the segregated
+ * lists with the placement policy set by mm_set_policy, FIT_POLICY
+ * by default
  */
 #define NEXT_FITx
+#ifndef FIT_POLICY
+#define FIT_POLICY  MM_FIRST_FIT
+#endif
+
+/*
+ * If FIXED_POLICY defined the placement policy is FIT_POLICY and the
+ * coalescing mode COALESCE_MODE for good: both become constants, so the
+ * fit search and free carry no branches for the others, and
+ * mm_set_policy and mm_set_coalesce refuse any change
+ */
+#define FIXED_POLICYx
+
+/*
+ * If THREAD_CACHE defined keep a per-thread cache of small freed blocks
+ * and serialize the shared heap with heap_lock, else run unlocked
+ */
+#define THREAD_CACHEx
+
+/*
+ * If ARENAS defined spread threads over ARENA_NUM locked heaps, else
+ * use the single mem_sbrk heap. If ARENA_BY_CPU defined a thread takes
+ * the arena of the CPU it first allocates on, else round-robin.
+ */
+#define ARENASx
+#define ARENA_BY_CPUx
+
+/*
+ * If HEAP_TRIM defined give memory back on free: shrink the heap when the
+ * top free block passes TRIM_THRESHOLD, and release the pages inside
+ * free blocks of at least RELEASE_THRESHOLD
+ */
+#define HEAP_TRIMx
+
+/*
+ * If HUGE_MMAP defined serve requests of at least MMAP_THRESHOLD bytes
+ * with their own mapping from mem_map, outside the heap. mdriver checks
+ * that blocks lie inside the heap, so leave this off when grading.
+ */
+#define HUGE_MMAPx
+
+/*
+ * If SIZE_TREE defined keep free blocks above TREE_MIN in one red-black
+ * tree ordered by (size, address) instead of the large lists
+ */
+#define SIZE_TREEx
+
+/*
+ * If DEFER_COALESCE defined small freed blocks can wait on per-size quick
+ * lists, still marked allocated, until a fit search misses; mm_set_coalesce
+ * picks the mode, deferred by default
+ */
+#define DEFER_COALESCEx
+#ifndef COALESCE_MODE
+#ifdef DEFER_COALESCE
+#define COALESCE_MODE  MM_DEFERRED
+#else
+#define COALESCE_MODE  MM_EAGER
+#endif
+#endif
+
+/*
+ * If SLAB defined serve requests of up to SLAB_MAX bytes from RUN_SIZE
+ * aligned runs of equal slots carved out of the heap, with no header
+ * per slot
+ */
+#define SLABx
+
+/*
+ * If WIDE_HEAP defined headers, footers and list links are 8-byte words,
+ * lifting the 4 GB limit on the heap span that 4-byte offsets impose,
+ * and payloads are 16-byte aligned
+ */
+#define WIDE_HEAPx
+
+/*
+ * If CTL_BLOCK defined keep the list entries and their bitmap in a cache
+ * line aligned control block outside the heap, and the mm_stats counters
+ * on lines of their own, else at the base of the heap
+ */
+#define CTL_BLOCKx
+
+/*
+ * If NO_STATS defined keep no mm_stats counters, so the allocation paths
+ * skip the counting and the size class lookups it needs, and mm_stats
+ * reports zeros
+ */
+#define NO_STATSx
+
+/*
+ * If CHECK_HEAP defined check the heap while it runs, in three tiers:
+ * every free and realloc checks the header of its block, and the next
+ * header when it takes the heap lock; every CHECK_SAMPLE-th heap
+ * operation walks up to CHECK_LIST_MAX blocks of one free list; and
+ * every operation advances a walk over the whole heap by CHECK_STEP
+ * blocks. A failed check reports the block and aborts.
+ */
+#define CHECK_HEAPx
+
+#if defined(ARENAS) && defined(NEXT_FIT)
+#error "NEXT_FIT keeps a single rover and cannot be used with ARENAS"
+#endif
+#if defined(ARENAS) && defined(CHECK_HEAP)
+#error "CHECK_HEAP walks the single mem_sbrk heap and cannot be used with ARENAS"
+#endif
+#if defined(ARENAS) && defined(SLAB)
+#error "SLAB finds runs through a page map of the mem_sbrk heap and cannot be used with ARENAS"
+#endif
+#if defined(WIDE_HEAP) && defined(SLAB)
+#error "SLAB keeps 4-byte run offsets and a 4 GB page map and cannot be used with WIDE_HEAP"
+#endif
 
 /* $begin mallocmacros */
-/* Basic constants and macros */
+/*
+ * Block layout: every macro below works on word_t, so one set serves both
+ * widths. The compact layout keeps blocks and offsets from heap_listp
+ * below HEAP_SPAN; the wide one doubles metadata and the minimum block.
+ */
+#ifdef WIDE_HEAP
+typedef unsigned long word_t;
+#define WSIZE       8       /* Word and header/footer size (bytes) */
+#define DSIZE       16      /* Doubleword size (bytes) */
+#define HEAP_SPAN   ((size_t)-1)
+#else
+typedef unsigned int word_t;
 #define WSIZE       4       /* Word and header/footer size (bytes) */
 #define DSIZE       8       /* Doubleword size (bytes) */
-#define CHUNKSIZE  (1<<8)-(1<<5)  /* Extend heap by this amount (bytes) */
-
-/* Define different size of different free list */
-#define LIST1       (1<<4)
-#define LIST2        24
-#define LIST3        48
-#define LIST4       (1<<7)
-#define LIST5       (1<<8)
-#define LIST6       (1<<9)
-#define LIST7       (1<<10)
-#define LIST8       (1<<11)
-#define LIST9       (1<<12)
-#define LIST10       9200
-#define LIST11       12000
-#define LIST12       16000
-#define LIST13       20000
-#define LIST14       24000
-#define LIST15       28000
-#define LIST16       32000
-#define LIST17       40000
-#define LIST18      (1<<15)
-#define LIST19      (1<<16)
-#define LIST20      (1<<17)
-#define LIST21      (1<<18)
-#define LIST22      (1<<19)
-#define LIST23      (1<<20)
-
-#define LIST_NUM 24        /* Number of free list */
+#define HEAP_SPAN   ((size_t)1<<32)
+#endif
+
+/* Basic constants and macros */
+#ifndef CHUNKSIZE
+#define CHUNKSIZE  ((1<<8)-(1<<5))  /* Extend heap by at least this amount (bytes) */
+#endif
+
+/*
+ * Upper bound (inclusive) of block size held by each free list, in
+ * ascending order. The last entry must be (size_t)-1 so that every size
+ * has a list, and the number of free lists is the length of the table.
+ * Retune the size classes here, or give a build its own LIST_LIMITS;
+ * list_init() derives the lookup from it.
+ */
+#ifndef LIST_LIMITS
+#define LIST_LIMITS \
+    (1<<4),  24,      48,      (1<<7),  (1<<8),  (1<<9),  \
+    (1<<10), (1<<11), (1<<12), 9200,    12000,   16000,   \
+    20000,   24000,   28000,   32000,   40000,   (1<<16), \
+    (1<<17), (1<<18), (1<<19), (1<<20), (1<<21), (size_t)-1
+#endif
+
+/* Sizes up to LIST_SMALL are classed by a table indexed by size/DSIZE */
+#define LIST_SMALL      (1<<10)
+#define LIST_SMALL_LOG  10
+
+/* Larger sizes are classed by power of two, split into LIST_SUB pieces */
+#define LIST_SUB_LOG    3
+#define LIST_SUB        (1<<LIST_SUB_LOG)
+#define LIST_LARGE_NUM  ((8*sizeof(size_t)-LIST_SMALL_LOG)*LIST_SUB)
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))
+#define MIN(x, y) ((x) < (y)? (x) : (y))
+
+/* Largest request served from the heap: mem_sbrk takes an int */
+#define MAX_REQUEST  ((size_t)INT_MAX - 4*DSIZE)
+
+/* Bytes a block spends besides its payload: allocated blocks keep a
+ * header but no footer */
+#define BLOCK_OVERHEAD  WSIZE
+
+/* Block size for a request: payload plus overhead, doubleword aligned,
+ * and at least the minimum block */
+#define ADJUST_SIZE(size)  ((size) <= 2*DSIZE - BLOCK_OVERHEAD ? 2*DSIZE : \
+                            DSIZE * (((size) + BLOCK_OVERHEAD + (DSIZE-1)) / DSIZE))
+
+/* Extra payload reserved when realloc has to move a growing block, so
+ * that its next growths can stay in place */
+#ifndef REALLOC_RESERVE
+#define REALLOC_RESERVE(size)  (size)
+#endif
+
+/* Regions bump-allocate in chunks taken with mm_malloc. Chunks double
+ * from the size given to mm_region_create up to REGION_CHUNK_MAX; the
+ * first word of each links the chunks, newest first. */
+#ifndef REGION_CHUNK
+#define REGION_CHUNK      4096
+#endif
+#define REGION_CHUNK_MAX  (1<<20)
+#define CHUNK_HDR         DSIZE        /* Link word, padded to alignment */
+#define CHUNK_NEXT(c)     (*(char **)(c))
+
+struct mm_region {
+    char *cur, *end;   /* Free space left in the newest chunk */
+    char *chunks;      /* Newest chunk, or NULL */
+    size_t chunk;      /* Size of the next chunk */
+};
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)  ((size) | (alloc))
 
 /* Read and write a word at address p */
-#define GET(p)          (*(unsigned int *)(p))
+#define GET(p)          (*(word_t *)(p))
 #define PUT_HD(p, val)  (GET(p) = (GET(p) & 0x2) | (val))  /* Keep former second bit for a/f of prev block */
 #define PUT(p, val)    (GET(p) = (val))
 
@@ -136,43 +372,505 @@
 /* Given block ptr bp, computer status(a/f) of prev block */
 #define GET_PREV_ALLOC(bp)  (GET(HDRP(bp)) & (0x2))
 
+/* Bitmap of non-empty free lists, stored just before the list entries */
+#define LIST_MAP  GET(free_listp - WSIZE)
+
+/* Thread cache: one bin per block size from 2*DSIZE up to TC_MAX */
+#ifndef TC_MAX
+#define TC_MAX     (1<<8)           /* Largest block size kept in a bin */
+#endif
+#define TC_NUM     (TC_MAX/DSIZE-1) /* Number of bins */
+#ifndef TC_COUNT
+#define TC_COUNT   32               /* Blocks a bin holds before flushing */
+#endif
+#ifndef TC_BATCH
+#define TC_BATCH   8                /* Blocks moved per refill or flush */
+#endif
+#define TC_BIN(asize)  ((asize)/DSIZE-2)
+
+/* Next cached block, stored in the payload of a cached block */
+#define TC_NEXT(bp)  (*(char **)(bp))
+
+/* Heap trimming: top block size that triggers a shrink, size kept after it,
+ * and interior free block size whose pages are released */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD     (1<<17)
+#endif
+#ifndef TRIM_KEEP
+#define TRIM_KEEP          (1<<12)
+#endif
+#ifndef RELEASE_THRESHOLD
+#define RELEASE_THRESHOLD  (1<<18)
+#endif
+
+/* Placement: candidates best fit examines per list, and largest block
+ * size kept in LIFO order under address-ordered fit */
+#ifndef BEST_FIT_K
+#define BEST_FIT_K  8
+#endif
+#ifndef ADDR_MIN
+#define ADDR_MIN    (1<<12)
+#endif
+
+/* Size tree: largest block kept on the lists. Must be one of LIST_LIMITS. */
+#ifndef TREE_MIN
+#define TREE_MIN    (1<<12)
+#endif
+
+/* Tree links of a free block, stored as offsets in its payload (0 is
+ * null), and its colour */
+#define T_CHILD(bp, d)  ((word_t *)(bp) + (d))    /* d: 0 left, 1 right */
+#define T_PARENT(bp)    ((word_t *)(bp) + 2)
+#define T_RED(bp)       (*((word_t *)(bp) + 3))
+#define T_GET(p)        (*(p) ? heap_listp + *(p) : NULL)
+#define T_SET(p, bp)    (*(p) = (bp) ? (word_t)((char *)(bp) - heap_listp) : 0)
+
+/* Heap growth: a miss within GROW_WINDOW allocations of the last one
+ * doubles the extension, up to GROW_MAX and 1/GROW_FRAC of the heap */
+#ifndef GROW_WINDOW
+#define GROW_WINDOW 64
+#endif
+#ifndef GROW_MAX
+#define GROW_MAX    (1<<16)
+#endif
+#ifndef GROW_FRAC
+#define GROW_FRAC   16
+#endif
+
+/* Deferred coalescing: largest block kept on a quick list, and number of
+ * quick list entries (one per block size from 2*DSIZE) */
+#ifndef QUICK_MAX
+#define QUICK_MAX   (1<<8)
+#endif
+#ifdef DEFER_COALESCE
+#define QUICK_NUM   (QUICK_MAX/DSIZE-1)
+#else
+#define QUICK_NUM   0
+#endif
+#define QUICK_LIST(asize)  ((word_t *)free_listp + LIST_NUM + (asize)/DSIZE - 2)
+
+/* Slab runs: largest request served, slot size step, run size and
+ * alignment, bytes of run header, and size of the 4 GB run page map */
+#ifndef SLAB_MAX
+#define SLAB_MAX      64
+#endif
+#define SLAB_STEP     DSIZE
+#define SLAB_NUM      (SLAB_MAX/SLAB_STEP)
+#define RUN_SIZE      (1<<12)
+#define RUN_HDR       ((int)sizeof(struct run))
+#define RUN_MAP_BITS  ((1UL<<32)/RUN_SIZE)
+
+/* Run holding a slot, and whether an address lies in a run */
+#define RUN_OF(bp)    ((struct run *)((size_t)(bp) & ~(size_t)(RUN_SIZE-1)))
+#define RUN_IDX(bp)   (((size_t)(bp) - (size_t)mem_heap_lo()) / RUN_SIZE)
+#define IS_SLAB(bp)   ((char *)(bp) >= (char *)mem_heap_lo() && \
+                       RUN_IDX(bp) < RUN_MAP_BITS && \
+                       (run_map[RUN_IDX(bp)/8] >> (RUN_IDX(bp)%8) & 1))
+
+/* Heap checks: operations per sampled free list walk, blocks of the
+ * list walked, and blocks the heap walk advances per operation */
+#ifndef CHECK_SAMPLE
+#define CHECK_SAMPLE    64
+#endif
+#ifndef CHECK_LIST_MAX
+#define CHECK_LIST_MAX  64
+#endif
+#ifndef CHECK_STEP
+#define CHECK_STEP      2
+#endif
+
+#ifdef CHECK_HEAP
+#define CHECK_HEADER(bp)  check_op(bp, check_header(bp))
+#define CHECK_FREE(bp)    check_op(bp, check_next(bp))
+#define CHECK_TICK()      check_tick()
+#else
+#define CHECK_HEADER(bp)
+#define CHECK_FREE(bp)
+#define CHECK_TICK()
+#endif
+
+/* Huge blocks: request size served by mem_map, and room before the payload
+ * for the mapping length and the tagged header */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD  (1<<20)
+#endif
+#define MMAP_HDR        (2*DSIZE)
+
+/* Read the huge block tag of a header, and the mapping length before it */
+#define IS_MMAPPED(bp)  (GET(HDRP(bp)) & 0x4)
+#define MMAP_LEN(bp)    (*(size_t *)((char *)(bp) - MMAP_HDR))
+
+/* Control block: alignment of the list entries and counters */
+#define CACHE_LINE  64
+#ifdef CTL_BLOCK
+#define CTL_ALIGNED  __attribute__((aligned(CACHE_LINE)))
+#else
+#define CTL_ALIGNED
+#endif
+
+/* Arenas: number of heaps and reserved span of each mem_map region */
+#ifndef ARENA_NUM
+#define ARENA_NUM   4
+#endif
+#define ARENA_SIZE  (1UL<<30)     /* Must stay below 4 GB for 4-byte offsets */
+
+/*
+ * LOCK() takes the heap the calling thread allocates from, LOCK_FOR(bp)
+ * the heap block bp belongs to. Both select that heap's free lists.
+ */
+#if defined(ARENAS)
+#define LOCK()        arena_enter(thread_arena())
+#define LOCK_FOR(bp)  arena_enter(arena_of(bp))
+#define UNLOCK()      arena_leave()
+#elif defined(THREAD_CACHE)
+#define LOCK()        pthread_mutex_lock(&heap_lock)
+#define LOCK_FOR(bp)  LOCK()
+#define UNLOCK()      pthread_mutex_unlock(&heap_lock)
+#else
+#define LOCK()
+#define LOCK_FOR(bp)
+#define UNLOCK()
+#endif
+
+/* With arenas the current heap is per thread: arena_enter loads it from
+ * the arena and arena_leave saves the growth state back */
+#ifdef ARENAS
+#define HEAP_LOCAL  __thread
+#else
+#define HEAP_LOCAL
+#endif
+
 /* $end mallocmacros */
 
+/* Size class table and the number of free lists it defines */
+static const size_t list_limit[] = { LIST_LIMITS };
+#define LIST_NUM ((int)(sizeof(list_limit)/sizeof(list_limit[0])))
+
+/* Words of list heads laid out before the prologue, plus a spare when
+ * needed: prologue alignment in mm_init relies on an even number */
+#define HEAD_NUM ((LIST_NUM + QUICK_NUM + 1) & ~1)
+
+/* Every list needs a bit in the one-word LIST_MAP */
+_Static_assert(LIST_NUM <= 8*WSIZE, "LIST_NUM must fit in LIST_MAP");
+_Static_assert(LIST_NUM <= MM_STATS_CLASSES, "LIST_NUM must fit in struct mm_stats");
+
+/* Parameters a configuration may set, within what the code relies on */
+_Static_assert(CHUNKSIZE % DSIZE == 0, "CHUNKSIZE must be a multiple of DSIZE");
+_Static_assert(TC_MAX % DSIZE == 0 && TC_MAX >= 2*DSIZE, "TC_MAX must be a block size");
+_Static_assert(QUICK_MAX % DSIZE == 0, "QUICK_MAX must be a block size");
+_Static_assert(SLAB_MAX % SLAB_STEP == 0, "SLAB_MAX must be a multiple of SLAB_STEP");
+_Static_assert(GROW_FRAC > 0 && BEST_FIT_K > 0, "GROW_FRAC and BEST_FIT_K must be positive");
+
+#ifdef CTL_BLOCK
+/*
+ * The list heads of a heap: LIST_MAP followed by the entries, in the
+ * order heap_init lays them out at the heap base without CTL_BLOCK
+ */
+struct ctl {
+    word_t map;
+    word_t head[HEAD_NUM];
+} CTL_ALIGNED;
+#endif
+
+/* Counters for mm_stats; shared by all threads when heaps are per thread */
+#if defined(NO_STATS)
+#define STAT_ADD(f, n)  ((void)0)
+#elif defined(THREAD_CACHE) || defined(ARENAS)
+#define STAT_ADD(f, n)  __atomic_fetch_add(&stats.f, (n), __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(f, n)  (stats.f += (n))
+#endif
+#define STAT_CLASS(size)  list_entry(ADJUST_SIZE(size))
+
 /* Global variables */
-static char *heap_listp = 0;   /* Pointer to first block */
-static char *free_listp = 0;   /* Pointer to beginning of free list */
+static HEAP_LOCAL char *heap_listp = 0;   /* Pointer to first block */
+static HEAP_LOCAL char *free_listp = 0;   /* Pointer to beginning of free list */
+static HEAP_LOCAL size_t grow_chunk;      /* Current heap extension (bytes) */
+static HEAP_LOCAL unsigned int grow_ops;  /* Allocations since the last extension */
+
+/* Smallest candidate free list for a size, built from list_limit */
+static unsigned char list_small[LIST_SMALL/DSIZE];
+static unsigned char list_large[LIST_LARGE_NUM];
+static int list_ready = 0;
+static struct mm_stats stats CTL_ALIGNED;  /* Counters since mm_init */
+static int addr_list;                 /* First list kept in address order */
+#ifdef FIXED_POLICY
+#define fit_policy     FIT_POLICY
+#define coalesce_mode  COALESCE_MODE
+#else
+static int fit_policy = FIT_POLICY;
+static int next_policy = FIT_POLICY;  /* From mm_set_policy, for mm_init */
+#endif
+#if defined(DEFER_COALESCE) && !defined(FIXED_POLICY)
+static int coalesce_mode = COALESCE_MODE;
+#endif
+#ifdef SIZE_TREE
+static int tree_list;                 /* List entry holding the tree root */
+#endif
 
 
 #ifdef NEXT_FIT
 static char *rover;           /* Next fit rover */
 #endif
 
+#ifdef CHECK_HEAP
+static char *check_bp;        /* Next block of the heap walk */
+static unsigned int check_ops;    /* Operations since the last list walk */
+static int check_entry;       /* Free list the next sampled walk takes */
+#endif
+
+#ifdef SLAB
+/*
+ * A run starts with this header and is cut into equal slots after it.
+ * It is the payload of an allocated heap block; runs with a free slot
+ * are chained per slot size through heap offsets.
+ */
+struct run {
+    unsigned int size;                /* Slot size */
+    unsigned int nfree;               /* Free slots */
+    unsigned int next, prev;          /* Offsets in the partial run list */
+    unsigned long long map[(RUN_SIZE/SLAB_STEP+63)/64];   /* 1 if slot free */
+};
+static unsigned int run_partial[SLAB_NUM];     /* Runs with free slots */
+static unsigned char run_map[RUN_MAP_BITS/8];  /* Bit per RUN_SIZE page: is a run */
+static size_t run_map_top;                     /* Bytes of run_map in use */
+#endif
+
+#if defined(THREAD_CACHE) || defined(ARENAS)
+static unsigned int heap_epoch = 0;   /* Bumped by mm_init to drop stale caches */
+#endif
+
+#ifdef ARENAS
+/*
+ * An arena is a self-contained heap: its own prologue, list entries
+ * and offsets relative to its own heap_listp. lo is NULL for arena 0,
+ * which grows through mem_sbrk.
+ */
+struct arena {
+    pthread_mutex_t lock;
+    char *heap_listp;
+    char *free_listp;
+    char *lo;                         /* Start of mem_map region */
+    char *brk;                        /* Current break within region */
+    char *clean;                      /* Region never handed out from here */
+    size_t grow_chunk;                /* Heap growth state, see grow_size */
+    unsigned int grow_ops;
+#ifdef CTL_BLOCK
+    struct ctl ctl;
+#endif
+};
+static struct arena arenas[ARENA_NUM] = {
+    [0 ... ARENA_NUM-1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards arena creation */
+static unsigned int arena_next = 0;   /* Round-robin assignment */
+static __thread struct arena *cur_arena;      /* Arena held by this thread */
+static __thread struct arena *my_arena;       /* Arena this thread allocates from */
+static __thread unsigned int my_epoch;
+#endif
+
+#if defined(THREAD_CACHE) && !defined(ARENAS)
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Control block of the heap being laid out by heap_init */
+#if defined(CTL_BLOCK) && defined(ARENAS)
+#define HEAP_CTL  (cur_arena->ctl)
+#elif defined(CTL_BLOCK)
+static struct ctl heap_ctl;
+#define HEAP_CTL  heap_ctl
+#endif
+
+#ifdef THREAD_CACHE
+/*
+ * Blocks in a thread cache stay marked allocated in the heap, so the
+ * shared lists and coalesce() never see them.
+ */
+struct tcache {
+    unsigned int epoch;               /* heap_epoch the bins belong to */
+    int registered;                   /* Exit destructor installed */
+    int count[TC_NUM];
+    char *bin[TC_NUM];
+};
+static __thread struct tcache tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+#endif
+
 /* Function prototypes for internal helper routines */
 static void *extend_heap(size_t words);
+static size_t grow_size(size_t asize);
 static void place(void *bp, size_t asize);
 static void *find_fit(size_t asize);
 static void *coalesce(void *bp);
 static void printblock(void *bp);
-static void checkblock(void *bp);
+static const char *check_block(void *bp);
+static const char *check_list(int entry, size_t max, char **at);
+#ifdef CHECK_HEAP
+static const char *check_header(void *bp);
+static const char *check_next(void *bp);
+static void check_op(void *bp, const char *err);
+static void check_tick(void);
+#endif
 static void *find_block(void *list,size_t asize);
+static void list_init(void);
+static inline int list_entry(size_t size);
+static inline void freelist_insert(void *bp);
+static inline void freelist_delete(void *bp);
+#ifdef SIZE_TREE
+static void tree_insert(void *bp);
+static void tree_delete(void *bp);
+static void *tree_fit(size_t asize);
+#endif
+static void *malloc_block(size_t asize);
+static void free_block(void *bp);
+static size_t malloc_run(size_t asize, size_t n, void **out);
+static void *fit_run(size_t asize, size_t n, size_t *k);
+static void carve(void *bp, size_t asize, size_t n, void **out);
+static void free_run(void *bp, size_t size);
+#ifdef DEFER_COALESCE
+static int quick_flush(void);
+#endif
+static void *realloc_block(void *bp, size_t asize);
+static int heap_init(void);
+#ifdef HEAP_TRIM
+static void heap_trim(void *bp);
+#endif
+#ifdef HUGE_MMAP
+static void *mmap_block(size_t size);
+static void *mmap_realloc(void *ptr, size_t size);
+#endif
+#ifdef ARENAS
+static inline void arena_enter(struct arena *a);
+static inline void arena_leave(void);
+static inline struct arena *arena_of(void *bp);
+static struct arena *thread_arena(void);
+static void arenas_reset(void);
+#endif
+#ifdef SLAB
+static void *slab_alloc(size_t size);
+static void slab_free(void *bp);
+static void slab_reset(void);
+#endif
+#ifdef THREAD_CACHE
+static void *tcache_get(size_t asize);
+static int tcache_put(void *bp, size_t size);
+#endif
 /*
  * mm_init - Initialize the memory manager
  */
 /* $begin mminit */
 int mm_init(void)
+{
+    if (!list_ready)                                        /* Build size class lookup once */
+        list_init();
+    memset(&stats, 0, sizeof(stats));
+#ifndef FIXED_POLICY
+    fit_policy = next_policy;                               /* Lists start empty */
+#endif
+    
+#ifdef ARENAS
+    arenas_reset();                                         /* Caller now owns arena 0 */
+#endif
+#if defined(THREAD_CACHE) || defined(ARENAS)
+    heap_epoch++;
+#endif
+#ifdef SLAB
+    slab_reset();
+#endif
+#ifdef ARENAS
+    my_epoch = heap_epoch;
+    if (heap_init() < 0)
+        return -1;
+    arenas[0].heap_listp = heap_listp;
+    arenas[0].free_listp = free_listp;
+    arenas[0].grow_chunk = grow_chunk;
+    arenas[0].grow_ops = grow_ops;
+    return 0;
+#else
+    return heap_init();
+#endif
+}
+/* $end mminit */
+
+/*
+ * heap_sbrk - Grow the current heap by incr bytes, or shrink it if negative
+ */
+static void *heap_sbrk(int incr)
+{
+#ifdef ARENAS
+    char *old_brk = cur_arena->brk;
+    
+    if (cur_arena->lo == NULL)                              /* Arena 0 */
+        return mem_sbrk(incr);
+    if (old_brk + incr < cur_arena->lo || old_brk + incr > cur_arena->lo + ARENA_SIZE)
+        return (void *)-1;
+    cur_arena->brk += incr;
+    if (incr < 0)
+        mem_release(cur_arena->brk, -incr);
+    if (cur_arena->brk > cur_arena->clean)
+        cur_arena->clean = cur_arena->brk;
+    return old_brk;
+#else
+    return mem_sbrk(incr);
+#endif
+}
+
+/*
+ * heap_top - Current break of the current heap
+ */
+static inline char *heap_top(void)
+{
+#ifdef ARENAS
+    if (cur_arena->lo != NULL)
+        return cur_arena->brk;
+#endif
+    return (char *)mem_heap_hi() + 1;
+}
+
+/*
+ * heap_clean - First byte of the current heap never handed out by
+ *              heap_sbrk; memory from there up reads as zero
+ */
+static inline char *heap_clean(void)
+{
+#ifdef ARENAS
+    if (cur_arena->lo != NULL)
+        return cur_arena->clean;
+#endif
+    return mem_heap_clean();
+}
+
+/*
+ * heap_init - Lay out an empty heap at the current break
+ */
+/* $begin mminit */
+static int heap_init(void)
 {
     /* Create the initial empty heap */
-    if ((heap_listp = mem_sbrk(4*WSIZE+(LIST_NUM)*WSIZE)) == (void *)-1)
+#ifdef CTL_BLOCK
+    if ((heap_listp = heap_sbrk(4*WSIZE)) == (void *)-1)
         return -1;
     PUT(heap_listp, 0);                                     /* Alignment padding */
-    PUT(heap_listp + ((LIST_NUM+1)*WSIZE), PACK(DSIZE, 1)); /* Prologue header */
-    PUT(heap_listp + ((LIST_NUM+2)*WSIZE), PACK(DSIZE, 1)); /* Prologue footer */
-    PUT(heap_listp + ((LIST_NUM+3)*WSIZE), PACK(0, 1));     /* Epilogue header */
+    PUT(heap_listp + (1*WSIZE), PACK(DSIZE, 1));            /* Prologue header */
+    PUT(heap_listp + (2*WSIZE), PACK(DSIZE, 1));            /* Prologue footer */
+    PUT(heap_listp + (3*WSIZE), PACK(0, 1));                /* Epilogue header */
+    free_listp = (char *)HEAP_CTL.head;                     /* Entries are in the control block */
+    LIST_MAP = 0;
+    heap_listp += (2*WSIZE);
+#else
+    if ((heap_listp = heap_sbrk(4*WSIZE+(HEAD_NUM)*WSIZE)) == (void *)-1)
+        return -1;
+    PUT(heap_listp, 0);                                     /* Bitmap of non-empty lists */
+    PUT(heap_listp + ((HEAD_NUM+1)*WSIZE), PACK(DSIZE, 1)); /* Prologue header */
+    PUT(heap_listp + ((HEAD_NUM+2)*WSIZE), PACK(DSIZE, 1)); /* Prologue footer */
+    PUT(heap_listp + ((HEAD_NUM+3)*WSIZE), PACK(0, 1));     /* Epilogue header */
     free_listp = heap_listp + (1*WSIZE);                    /* Point to beginning of free list */
-    heap_listp += ((LIST_NUM+2)*WSIZE);                     /* Heap_listp point to prologue block */
+    heap_listp += ((HEAD_NUM+2)*WSIZE);                     /* Heap_listp point to prologue block */
+#endif
     PREV_ALLOC(heap_listp);
     
-    for(int i = 0; i < (LIST_NUM); i++){                    /* Initialize free_list */
+    for(int i = 0; i < (HEAD_NUM); i++){                    /* Initialize free and quick lists */
         PUT(free_listp+i*WSIZE,0);
     }
     
@@ -180,10 +878,16 @@ int mm_init(void)
     
 #ifdef NEXT_FIT
     rover = heap_listp;
+#endif
+#ifdef CHECK_HEAP
+    check_bp = NULL;
+    check_ops = 0;
 #endif
     /* $begin mminit */
     
     /* Extend the empty heap with a free block of CHUNKSIZE bytes */
+    grow_chunk = CHUNKSIZE;
+    grow_ops = 0;
     if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
         return -1;
     
@@ -198,23 +902,76 @@ int mm_init(void)
 void *mm_malloc(size_t size)
 {
     size_t asize;      /* Adjusted block size */
-    size_t extendsize; /* Amount to extend heap if no fit */
     char *bp;
     
-    /* $end mmmalloc */
-    if (heap_listp == 0){
-        mm_init();
-    }
     /* $begin mmmalloc */
     /* Ignore spurious requests */
     if (size == 0)
         return NULL;
     
+#ifdef HUGE_MMAP
+    if (size >= MMAP_THRESHOLD) {
+        STAT_ADD(mallocs[LIST_NUM-1], 1);
+        return mmap_block(size);
+    }
+#endif
+#ifdef SLAB
+    if (size <= SLAB_MAX) {
+        STAT_ADD(mallocs[STAT_CLASS(size)], 1);
+        LOCK();
+        bp = slab_alloc(size);
+        UNLOCK();
+        return bp;
+    }
+#endif
+    
+    if (size > MAX_REQUEST)
+        return NULL;
+    
     /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= DSIZE)
-        asize = 2*DSIZE;
-    else
-        asize = DSIZE * ((size + (WSIZE) + (DSIZE-1)) / DSIZE);
+    asize = ADJUST_SIZE(size);
+    STAT_ADD(mallocs[list_entry(asize)], 1);
+    
+#ifdef THREAD_CACHE
+    if (asize <= TC_MAX)
+        return tcache_get(asize);
+#endif
+    
+    LOCK();
+    bp = malloc_block(asize);
+    UNLOCK();
+    return bp;
+}
+/* $end mmmalloc */
+
+/*
+ * malloc_block - Allocate a block of asize bytes from the shared
+ *                free lists, extending the heap if no fit
+ */
+static void *malloc_block(size_t asize)
+{
+    size_t extendsize; /* Amount to extend heap if no fit */
+    char *bp;
+    
+    if (heap_listp == 0){
+#ifdef ARENAS
+        return NULL;                        /* Arena could not be created */
+#else
+        mm_init();
+#endif
+    }
+    
+    CHECK_TICK();
+    
+#ifdef DEFER_COALESCE
+    if (asize <= QUICK_MAX && *QUICK_LIST(asize)) {         /* Reuse a deferred block */
+        bp = OFF_PTR(QUICK_LIST(asize));
+        PUT(QUICK_LIST(asize), GET(bp));
+        return bp;
+    }
+#endif
+    
+    grow_ops++;
     
     /* Search the free list for a fit */
     if ((bp = find_fit(asize)) != NULL) {
@@ -222,15 +979,22 @@ void *mm_malloc(size_t size)
         return bp;
     }
     
+#ifdef DEFER_COALESCE
+    /* Merge the deferred blocks, then search again */
+    if (quick_flush() && (bp = find_fit(asize)) != NULL) {
+        place(bp, asize);
+        return bp;
+    }
+#endif
+    
     /* No fit found. Get more memory and place the block */
-    extendsize = MAX(asize,CHUNKSIZE);
+    extendsize = grow_size(asize);
     if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
         return NULL;
     place(bp, asize);
     
     return bp;
 }
-/* $end mmmalloc */
 
 /*
  * mm_free - Free a block
@@ -244,84 +1008,922 @@ void mm_free(void *bp)
     if(bp == 0)
         return;
     
-    size_t size = GET_SIZE(HDRP(bp));
-
-    if (heap_listp == 0){                   /* Not yet initialized */
-        mm_init();
+#ifdef SLAB
+    if (IS_SLAB(bp)) {
+        STAT_ADD(frees[STAT_CLASS(RUN_OF(bp)->size)], 1);
+        LOCK();
+        slab_free(bp);
+        UNLOCK();
+        return;
     }
+#endif
+#ifdef HUGE_MMAP
+    if (IS_MMAPPED(bp)) {
+        STAT_ADD(frees[LIST_NUM-1], 1);
+        mem_unmap((char *)bp - MMAP_HDR, MMAP_LEN(bp));
+        return;
+    }
+#endif
+    CHECK_HEADER(bp);
+    STAT_ADD(frees[list_entry(GET_SIZE(HDRP(bp)))], 1);
+#ifdef THREAD_CACHE
+    if (tcache_put(bp, GET_SIZE(HDRP(bp))))
+        return;
+#endif
+    
+    LOCK_FOR(bp);
+    free_block(bp);
+    UNLOCK();
+}
+/* $end mmfree */
+
+/*
+ * mm_free_sized - Free a block given the size last requested for it by
+ *                 mm_malloc, mm_realloc or mm_memalign. A size above
+ *                 SLAB_MAX and below MMAP_THRESHOLD rules out a slab slot
+ *                 and a huge mapping without their tests, and picks the
+ *                 stats class. Under THREAD_CACHE a block the bins hold
+ *                 goes to the bin for that size without its header being
+ *                 read; the block may be a little larger, which the bin's
+ *                 requests can use. Others go to free_block, which reads
+ *                 the header for the true size and prev-alloc bit that
+ *                 coalescing needs.
+ */
+void mm_free_sized(void *bp, size_t size)
+{
+    if (bp == NULL || size == 0) {
+        mm_free(bp);
+        return;
+    }
+#ifdef SLAB
+    if (size <= SLAB_MAX) {                 /* May be a slab slot */
+        mm_free(bp);
+        return;
+    }
+#endif
+#ifdef HUGE_MMAP
+    if (size >= MMAP_THRESHOLD) {           /* May have its own mapping */
+        mm_free(bp);
+        return;
+    }
+#endif
+    STAT_ADD(frees[STAT_CLASS(size)], 1);
+#ifdef THREAD_CACHE
+    if (tcache_put(bp, ADJUST_SIZE(size)))
+        return;
+#endif
+    CHECK_HEADER(bp);
+    
+    LOCK_FOR(bp);
+    free_block(bp);
+    UNLOCK();
+}
+
+/*
+ * free_block - Return a block to the shared free lists
+ */
+static void free_block(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+
+    if (heap_listp == 0){                   /* Not yet initialized */
+        mm_init();
+    }
+    CHECK_FREE(bp);
+    CHECK_TICK();
+    
+#ifdef DEFER_COALESCE
+    if (coalesce_mode == MM_DEFERRED && size <= QUICK_MAX) {
+        PUT(bp, *QUICK_LIST(size));         /* Stays allocated until a miss */
+        PTR_OFF(QUICK_LIST(size), bp);
+        return;
+    }
+#endif
     
-    
+    free_run(bp, size);
+}
+
+/*
+ * free_run - Free size bytes of neighbouring allocated blocks starting
+ *            at bp as one block, coalescing it once
+ */
+static void free_run(void *bp, size_t size)
+{
     PUT_HD(HDRP(bp), PACK(size, 0));
     PUT(FTRP(bp), PACK(size, 0));
     PREV_UNALLOC(bp);
+#ifdef HEAP_TRIM
+    heap_trim(coalesce(bp));
+#else
     coalesce(bp);
+#endif
 }
-/* $end mmfree */
-
 
 /*
- * list_entry - serach for list that fits
+ * mm_malloc_batch - Allocate n blocks of size bytes into out, carving
+ *                   them from one free block or heap extension where
+ *                   possible. Returns the number allocated, less than
+ *                   n only when memory runs out.
  */
-/* $begin list_entry */
-static inline int list_entry(size_t size){
-    if (size<=LIST1){
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t asize, i = 0, k;
+    int single = 0;
+    
+    if (size == 0 || size > MAX_REQUEST)
         return 0;
+#ifdef HUGE_MMAP
+    single |= (size >= MMAP_THRESHOLD);
+#endif
+#ifdef SLAB
+    single |= (size <= SLAB_MAX);
+#endif
+    if (single) {                           /* Not served from heap blocks */
+        while (i < n && (out[i] = mm_malloc(size)) != NULL)
+            i++;
+        return i;
     }
-    else if (size<=LIST2){
-        return 1;
+    
+    asize = ADJUST_SIZE(size);
+    LOCK();
+    while (i < n && (k = malloc_run(asize, n - i, out + i)) > 0)
+        i += k;
+    UNLOCK();
+    STAT_ADD(mallocs[list_entry(asize)], i);
+    return i;
+}
+
+/*
+ * malloc_run - Carve up to n blocks of asize bytes from a single free
+ *              block: the free block that fits the longest run, halving
+ *              n, else one the heap grows by. Returns the number carved,
+ *              0 if out of memory.
+ */
+static size_t malloc_run(size_t asize, size_t n, void **out)
+{
+    char *bp;
+    size_t k;
+    
+    if (heap_listp == 0 || n == 1)          /* malloc_block sets up the heap */
+        return (out[0] = malloc_block(asize)) != NULL;
+    
+    n = MIN(n, MAX_REQUEST / asize);
+    CHECK_TICK();
+    grow_ops++;
+    bp = fit_run(asize, n, &k);
+#ifdef DEFER_COALESCE
+    if (bp == NULL && quick_flush())
+        bp = fit_run(asize, n, &k);
+#endif
+    if (bp != NULL) {
+        carve(bp, asize, k, out);
+        return k;
     }
-    else if (size<=LIST3){
-        return 2;
+    for (k = n; (bp = extend_heap(grow_size(asize * k)/WSIZE)) == NULL; k /= 2)
+        if (k == 1)
+            return 0;
+    carve(bp, asize, k, out);
+    return k;
+}
+
+/*
+ * fit_run - Find a free block for the longest run of up to n blocks of
+ *           asize bytes, halving n; sets *k to the run length
+ */
+static void *fit_run(size_t asize, size_t n, size_t *k)
+{
+    char *bp;
+    
+    for (*k = n; *k > 0; *k /= 2)
+        if ((bp = find_fit(asize * *k)) != NULL)
+            return bp;
+    return NULL;
+}
+
+/*
+ * carve - Split free block bp into n allocated blocks of asize bytes,
+ *         the last one taking a remainder too small to stand alone
+ */
+static void carve(void *bp, size_t asize, size_t n, void **out)
+{
+    size_t rest = GET_SIZE(HDRP(bp)) - asize * n;
+    
+    freelist_delete(bp);
+    STAT_ADD(splits, n - 1 + (rest >= 2*DSIZE));
+    for (size_t i = 0; i < n; i++) {
+        PUT_HD(HDRP(bp), PACK((i == n-1 && rest < 2*DSIZE) ? asize + rest : asize, 1));
+        PREV_ALLOC(bp);
+        out[i] = bp;
+        bp = NEXT_BLKP(bp);
     }
-    else if (size<=LIST4){
-        return 3;
+    if (rest >= 2*DSIZE) {
+        PUT_HD(HDRP(bp), PACK(rest, 0));
+        PUT(FTRP(bp), PACK(rest, 0));
+        PREV_UNALLOC(bp);
+        freelist_insert(bp);
     }
-    else if (size<=LIST5){
-        return 4;
+}
+
+/* Address order of two block pointers, for qsort */
+static int ptr_cmp(const void *a, const void *b)
+{
+    char *x = *(char * const *)a, *y = *(char * const *)b;
+    
+    return (x > y) - (x < y);
+}
+
+/*
+ * mm_free_batch - Free n blocks. ptrs is sorted in place by address so
+ *                 runs of neighbouring blocks are merged and coalesced
+ *                 once; null pointers are skipped.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    size_t i, j, size, bsize;
+    char *bp;
+    
+    for (i = 0; i < n; i++) {               /* Slab slots and huge blocks go one by one */
+        if (ptrs[i] == NULL)
+            continue;
+#ifdef SLAB
+        if (IS_SLAB(ptrs[i])) {
+            mm_free(ptrs[i]);
+            ptrs[i] = NULL;
+        }
+#endif
+#ifdef HUGE_MMAP
+        if (ptrs[i] != NULL && IS_MMAPPED(ptrs[i])) {
+            mm_free(ptrs[i]);
+            ptrs[i] = NULL;
+        }
+#endif
     }
-    else if (size<=LIST6){
-        return 5;
+    qsort(ptrs, n, sizeof(void *), ptr_cmp);
+    
+    for (i = 0; i < n; i = j) {
+        if ((bp = ptrs[i]) == NULL) {
+            j = i + 1;
+            continue;
+        }
+        size = 0;
+        for (j = i; j < n && ptrs[j] == bp + size; j++) {
+            CHECK_HEADER(ptrs[j]);
+            bsize = GET_SIZE(HDRP(ptrs[j]));
+            STAT_ADD(frees[list_entry(bsize)], 1);
+            size += bsize;
+        }
+        LOCK_FOR(bp);
+        CHECK_FREE(ptrs[j-1]);
+        CHECK_TICK();
+        free_run(bp, size);
+        UNLOCK();
+    }
+}
+
+/*
+ * mm_region_create - Make an empty region whose first chunk will be
+ *                    chunk_size bytes, REGION_CHUNK if 0. A region is
+ *                    not locked: one thread at a time may use it.
+ */
+struct mm_region *mm_region_create(size_t chunk_size)
+{
+    struct mm_region *r;
+    
+    if ((r = mm_malloc(sizeof(*r))) == NULL)
+        return NULL;
+    r->cur = r->end = r->chunks = NULL;
+    r->chunk = (chunk_size == 0) ? REGION_CHUNK : MIN(chunk_size, MAX_REQUEST);
+    return r;
+}
+
+/*
+ * mm_region_alloc - Allocate size bytes from region r, aligned as
+ *                   mm_malloc blocks are. A request of over a quarter
+ *                   of the newest chunk gets a chunk of its own, behind it,
+ *                   so the space left in the newest is not lost.
+ */
+void *mm_region_alloc(struct mm_region *r, size_t size)
+{
+    char *chunk, *bp;
+    size_t csize;
+    
+    if (size == 0 || size > MAX_REQUEST)
+        return NULL;
+    size = DSIZE * ((size + (DSIZE-1)) / DSIZE);
+    if (size <= (size_t)(r->end - r->cur)) {
+        bp = r->cur;
+        r->cur += size;
+        return bp;
+    }
+    
+    if (r->chunks != NULL && CHUNK_HDR + size > (size_t)(r->end - r->chunks) / 4) {
+        if ((chunk = mm_malloc(CHUNK_HDR + size)) == NULL)
+            return NULL;
+        CHUNK_NEXT(chunk) = CHUNK_NEXT(r->chunks);
+        CHUNK_NEXT(r->chunks) = chunk;
+        return chunk + CHUNK_HDR;
+    }
+    
+    csize = MAX(r->chunk, CHUNK_HDR + size);
+    if ((chunk = mm_malloc(csize)) == NULL)
+        return NULL;
+    CHUNK_NEXT(chunk) = r->chunks;
+    r->chunks = chunk;
+    r->cur = chunk + CHUNK_HDR + size;
+    r->end = chunk + csize;
+    if (r->chunk < REGION_CHUNK_MAX)
+        r->chunk = MIN(2 * r->chunk, REGION_CHUNK_MAX);
+    return chunk + CHUNK_HDR;
+}
+
+/*
+ * mm_region_reset - Free every block allocated from r. Each chunk but
+ *                   the newest goes back with one mm_free, whatever
+ *                   the number of blocks in it; the newest is reused.
+ */
+void mm_region_reset(struct mm_region *r)
+{
+    char *chunk, *next;
+    
+    if (r->chunks == NULL)
+        return;
+    for (chunk = CHUNK_NEXT(r->chunks); chunk != NULL; chunk = next) {
+        next = CHUNK_NEXT(chunk);
+        mm_free(chunk);
+    }
+    CHUNK_NEXT(r->chunks) = NULL;
+    r->cur = r->chunks + CHUNK_HDR;
+}
+
+/*
+ * mm_region_destroy - Free region r and every block allocated from it
+ */
+void mm_region_destroy(struct mm_region *r)
+{
+    mm_region_reset(r);
+    mm_free(r->chunks);
+    mm_free(r);
+}
+
+/*
+ * mm_memalign - Allocate size bytes at a multiple of alignment, a power
+ *               of two. The block is taken with room to spare; the slack
+ *               before the aligned payload becomes a free block of its
+ *               own and the slack after it is split off as on a shrink.
+ */
+void *mm_memalign(size_t alignment, size_t size)
+{
+    size_t asize, csize, lead;
+    char *bp, *ap;
+    
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        return NULL;
+    if (alignment <= DSIZE)
+        return mm_malloc(size);
+    if (size == 0 || alignment > MAX_REQUEST / 2 ||
+        size > MAX_REQUEST - alignment - 4*DSIZE)
+        return NULL;
+    
+    asize = ADJUST_SIZE(size);
+    STAT_ADD(mallocs[list_entry(asize)], 1);
+    LOCK();
+    if ((bp = malloc_block(asize + alignment + 2*DSIZE)) == NULL) {
+        UNLOCK();
+        return NULL;
+    }
+    
+    /* A leading free block needs at least the minimum block size */
+    ap = (char *)(((size_t)bp + alignment - 1) & ~(alignment - 1));
+    if (ap != bp && ap - bp < 2*DSIZE)
+        ap += alignment;
+    if ((lead = ap - bp) != 0) {
+        csize = GET_SIZE(HDRP(bp));
+        STAT_ADD(splits, 1);
+        PUT(HDRP(ap), PACK(csize - lead, 1));
+        free_run(bp, lead);
+    }
+    realloc_block(ap, asize);
+    UNLOCK();
+    return ap;
+}
+
+/*
+ * mm_aligned_alloc - C11 aligned_alloc: mm_memalign for a size that is
+ *                    a multiple of alignment
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || size % alignment != 0)
+        return NULL;
+    return mm_memalign(alignment, size);
+}
+
+#ifdef DEFER_COALESCE
+/*
+ * quick_flush - Free and coalesce every block waiting on a quick list.
+ *               Returns the number of blocks merged back.
+ */
+static int quick_flush(void)
+{
+    int n = 0;
+    char *bp;
+    
+    for (size_t size = 2*DSIZE; size <= QUICK_MAX; size += DSIZE) {
+        while (*QUICK_LIST(size)) {
+            bp = OFF_PTR(QUICK_LIST(size));
+            PUT(QUICK_LIST(size), GET(bp));
+            PUT_HD(HDRP(bp), PACK(size, 0));
+            PUT(FTRP(bp), PACK(size, 0));
+            PREV_UNALLOC(bp);
+            coalesce(bp);
+            n++;
+        }
     }
-    else if (size<=LIST7){
-        return 6;
+    return n;
+}
+#endif
+
+#ifdef HEAP_TRIM
+/*
+ * heap_trim - Give the memory of a large coalesced free block back to the
+ *             OS. The top block is cut down to TRIM_KEEP bytes and the
+ *             heap shrunk; pages inside other large blocks are released,
+ *             keeping the header, list or tree links and footer.
+ */
+static void heap_trim(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    size_t page = mem_pagesize();
+    size_t excess;
+    
+    if (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0 && size >= TRIM_THRESHOLD) {
+        excess = (size - TRIM_KEEP) & ~(page-1);
+        if (excess > (INT_MAX & ~(page-1)))     /* heap_sbrk takes an int */
+            excess = INT_MAX & ~(page-1);
+        if ((long)heap_sbrk(-(int)excess) == -1)
+            return;
+        freelist_delete(bp);
+        size -= excess;
+        PUT_HD(HDRP(bp), PACK(size, 0));
+        PUT(FTRP(bp), PACK(size, 0));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));   /* New epilogue, prev free */
+        freelist_insert(bp);
+    }
+    else if (size >= RELEASE_THRESHOLD)
+        mem_release((char *)bp + 2*DSIZE, size - 3*DSIZE);
+}
+#endif
+
+#ifdef THREAD_CACHE
+/*
+ * tcache_flush - Return up to n blocks of a bin to the shared lists
+ *                under a single acquisition of heap_lock
+ */
+static void tcache_flush(int bin, int n)
+{
+    char *bp;
+    
+    if ((bp = tcache.bin[bin]) == NULL)
+        return;
+    LOCK_FOR(bp);
+    while (n-- > 0 && (bp = tcache.bin[bin]) != NULL) {
+        tcache.bin[bin] = TC_NEXT(bp);
+        tcache.count[bin]--;
+#ifdef ARENAS
+        if (arena_of(bp) != cur_arena) {        /* Block of another arena */
+            UNLOCK();
+            LOCK_FOR(bp);
+        }
+#endif
+        free_block(bp);
+    }
+    UNLOCK();
+}
+
+/*
+ * tcache_exit - Thread exit destructor, flush every bin
+ */
+static void tcache_exit(void *arg)
+{
+    (void)arg;
+    if (tcache.epoch != heap_epoch)
+        return;
+    for (int bin = 0; bin < TC_NUM; bin++)
+        tcache_flush(bin, tcache.count[bin]);
+}
+
+static void tcache_key_init(void)
+{
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/*
+ * tcache_sync - Drop bins left over from a previous heap, and install
+ *               the exit destructor on first use by this thread
+ */
+static inline void tcache_sync(void)
+{
+    if (!tcache.registered) {
+        pthread_once(&tcache_once, tcache_key_init);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = 1;
     }
-    else if (size<=LIST8){
-        return 7;
+    if (tcache.epoch == heap_epoch)
+        return;
+    memset(tcache.count, 0, sizeof(tcache.count));
+    memset(tcache.bin, 0, sizeof(tcache.bin));
+    tcache.epoch = heap_epoch;
+}
+
+/*
+ * tcache_get - Pop a block of asize bytes from this thread's bin, or
+ *              refill the bin with TC_BATCH blocks under one lock
+ */
+static void *tcache_get(size_t asize)
+{
+    int bin = TC_BIN(asize);
+    char *bp;
+    
+    tcache_sync();
+    if ((bp = tcache.bin[bin]) != NULL) {
+        tcache.bin[bin] = TC_NEXT(bp);
+        tcache.count[bin]--;
+        return bp;
     }
-    else if (size<=LIST9){
-        return 8;
+    
+    LOCK();
+    if ((bp = malloc_block(asize)) != NULL) {
+        for (int i = 1; i < TC_BATCH; i++) {
+            char *extra = malloc_block(asize);
+            if (extra == NULL)
+                break;
+            TC_NEXT(extra) = tcache.bin[bin];
+            tcache.bin[bin] = extra;
+            tcache.count[bin]++;
+        }
     }
-    else if (size<=LIST10){
-        return 9;
+    UNLOCK();
+    
+    /* Heap may have been initialized by the refill itself */
+    tcache.epoch = heap_epoch;
+    return bp;
+}
+
+/*
+ * tcache_put - Push a freed block onto this thread's bin. Return 0 if
+ *              the block is too large to cache.
+ */
+static int tcache_put(void *bp, size_t size)
+{
+    int bin;
+    
+    if (size > TC_MAX)
+        return 0;
+    tcache_sync();
+    bin = TC_BIN(size);
+    TC_NEXT(bp) = tcache.bin[bin];
+    tcache.bin[bin] = bp;
+    if (++tcache.count[bin] >= TC_COUNT)
+        tcache_flush(bin, TC_BATCH);
+    return 1;
+}
+#endif
+
+#ifdef ARENAS
+/*
+ * arena_enter - Lock an arena and make its heap the current one
+ */
+static inline void arena_enter(struct arena *a)
+{
+    pthread_mutex_lock(&a->lock);
+    cur_arena = a;
+    heap_listp = a->heap_listp;
+    free_listp = a->free_listp;
+    grow_chunk = a->grow_chunk;
+    grow_ops = a->grow_ops;
+}
+
+/*
+ * arena_leave - Save the arena's growth state and unlock it
+ */
+static inline void arena_leave(void)
+{
+    cur_arena->grow_chunk = grow_chunk;
+    cur_arena->grow_ops = grow_ops;
+    pthread_mutex_unlock(&cur_arena->lock);
+}
+
+/*
+ * arena_of - Find the arena a block belongs to. Regions from mem_map are
+ *            ARENA_SIZE aligned and start with a pointer to their arena.
+ */
+static inline struct arena *arena_of(void *bp)
+{
+    if ((char *)bp >= (char *)mem_heap_lo() && (char *)bp <= (char *)mem_heap_hi())
+        return &arenas[0];
+    return *(struct arena **)((size_t)bp & ~(ARENA_SIZE-1));
+}
+
+/*
+ * arena_create - Map a region for an arena and lay out its empty heap.
+ *                Called with arena_lock held.
+ */
+static int arena_create(struct arena *a)
+{
+    int ret;
+    
+    if (a != &arenas[0]) {
+        if ((a->lo = mem_map(ARENA_SIZE, ARENA_SIZE)) == NULL)
+            return -1;
+        *(struct arena **)a->lo = a;                /* Owner word */
+        a->brk = a->clean = a->lo + DSIZE;
     }
-    else if (size<=LIST11){
-        return 10;
+    arena_enter(a);
+    ret = heap_init();
+    a->heap_listp = heap_listp;
+    a->free_listp = free_listp;
+    arena_leave();
+
+    if (ret < 0) {                                  /* Leave the slot unused */
+        a->heap_listp = 0;
+        if (a->lo != NULL)
+            mem_unmap(a->lo, ARENA_SIZE);
+        a->lo = NULL;
     }
-    else if (size<=LIST12){
-        return 11;
+    return ret;
+}
+
+/*
+ * thread_arena - Arena the calling thread allocates from, assigned on
+ *                its first allocation after each mm_init
+ */
+static struct arena *thread_arena(void)
+{
+    struct arena *a;
+    int idx;
+    
+    if (my_epoch == heap_epoch && my_arena != NULL)
+        return my_arena;
+    
+#ifdef ARENA_BY_CPU
+    if ((idx = sched_getcpu()) < 0)
+        idx = 0;
+#else
+    idx = __sync_fetch_and_add(&arena_next, 1);
+#endif
+    a = &arenas[idx % ARENA_NUM];
+    
+    pthread_mutex_lock(&arena_lock);
+    if (a->heap_listp == 0 && arena_create(a) < 0)
+        a = &arenas[0];                 /* Fall back to arena 0, set up by mm_init */
+    pthread_mutex_unlock(&arena_lock);
+    
+    my_arena = a;
+    my_epoch = heap_epoch;
+    return a;
+}
+
+/*
+ * arenas_reset - Drop every arena and bind the caller to arena 0, whose
+ *                heap mm_init is about to lay out
+ */
+static void arenas_reset(void)
+{
+    for (int i = 1; i < ARENA_NUM; i++) {
+        if (arenas[i].lo != NULL)
+            mem_unmap(arenas[i].lo, ARENA_SIZE);
+        arenas[i].lo = NULL;
+        arenas[i].heap_listp = 0;
+        pthread_mutex_init(&arenas[i].lock, NULL);
     }
-    else if (size<=LIST13){
-        return 12;
+    pthread_mutex_init(&arenas[0].lock, NULL);
+    arenas[0].lo = NULL;
+    arena_next = 1;
+    cur_arena = my_arena = &arenas[0];
+}
+#endif
+
+
+#ifdef SLAB
+/*
+ * run_place - Where a RUN_SIZE aligned run fits in free block bp, or NULL.
+ *             A front part left free must be able to stand as a block.
+ */
+static char *run_place(char *bp)
+{
+    char *rp = (char *)RUN_OF(bp + RUN_SIZE - 1);
+    
+    if (rp != bp && rp - bp < 2*DSIZE)
+        rp += RUN_SIZE;
+    if ((size_t)(rp - bp) + RUN_SIZE + DSIZE > GET_SIZE(HDRP(bp)))
+        return NULL;
+    return rp;
+}
+
+/*
+ * run_block - Carve a RUN_SIZE aligned run out of the heap. A free block
+ *             with room for it is split into a free front, the run block,
+ *             whose payload is the run, and a free tail. Without one the
+ *             heap is grown just enough to hold a run at its end.
+ */
+static struct run *run_block(void)
+{
+    size_t csize, gap, rsize;
+    char *bp, *rp, *tp, *brk;
+    
+    if ((bp = find_fit(2*RUN_SIZE + 2*DSIZE)) == NULL) {
+        brk = (char *)mem_heap_hi() + 1;
+        rp = (char *)RUN_OF(brk + 2*DSIZE + RUN_SIZE - 1);
+        if ((bp = extend_heap((rp - brk + RUN_SIZE + DSIZE)/WSIZE)) == NULL)
+            return NULL;
     }
-    else if (size<=LIST14){
-        return 13;
+    rp = run_place(bp);
+    freelist_delete(bp);
+    csize = GET_SIZE(HDRP(bp));
+    gap = rp - bp;
+    rsize = RUN_SIZE + DSIZE;
+    if (csize - gap - rsize < 2*DSIZE)                  /* Tail too small: keep it */
+        rsize = csize - gap;
+    
+    if (gap) {
+        PUT_HD(HDRP(bp), PACK(gap, 0));
+        PUT(FTRP(bp), PACK(gap, 0));
+        freelist_insert(bp);
+        PUT(HDRP(rp), PACK(rsize, 1));
     }
-    else if (size<=LIST15){
-        return 14;
+    else
+        PUT_HD(HDRP(rp), PACK(rsize, 1));
+    PREV_ALLOC(rp);
+    if (rsize < csize - gap) {
+        tp = NEXT_BLKP(rp);
+        PUT_HD(HDRP(tp), PACK(csize - gap - rsize, 0));
+        PUT(FTRP(tp), PACK(csize - gap - rsize, 0));
+        PREV_UNALLOC(tp);
+        freelist_insert(tp);
     }
-    else if (size<=LIST16){
-        return 15;
+    return (struct run *)rp;
+}
+
+/*
+ * run_link - Put a run at the head of the partial list of its slot size
+ */
+static void run_link(struct run *r)
+{
+    unsigned int *head = &run_partial[r->size/SLAB_STEP-1];
+    
+    r->prev = 0;
+    r->next = *head;
+    if (*head)
+        ((struct run *)(heap_listp + *head))->prev = (char *)r - heap_listp;
+    *head = (char *)r - heap_listp;
+}
+
+/*
+ * run_unlink - Take a run off the partial list of its slot size
+ */
+static void run_unlink(struct run *r)
+{
+    if (r->prev)
+        ((struct run *)(heap_listp + r->prev))->next = r->next;
+    else
+        run_partial[r->size/SLAB_STEP-1] = r->next;
+    if (r->next)
+        ((struct run *)(heap_listp + r->next))->prev = r->prev;
+}
+
+/*
+ * slab_alloc - Take a slot for a request of at most SLAB_MAX bytes from
+ *              a partial run of its slot size, starting a run if none
+ */
+static void *slab_alloc(size_t size)
+{
+    size_t ssize = (size + SLAB_STEP-1) & ~(size_t)(SLAB_STEP-1);
+    unsigned int off = run_partial[ssize/SLAB_STEP-1];
+    struct run *r;
+    size_t idx, n;
+    int w;
+    
+    if (heap_listp == 0)
+        mm_init();
+    
+    if (off)
+        r = (struct run *)(heap_listp + off);
+    else {
+        if ((r = run_block()) == NULL)
+            return NULL;
+        n = (RUN_SIZE - RUN_HDR) / ssize;
+        r->size = ssize;
+        r->nfree = n;
+        memset(r->map, 0, sizeof(r->map));
+        for (idx = 0; idx < n; idx++)
+            r->map[idx/64] |= 1ULL << (idx%64);
+        idx = RUN_IDX(r);
+        run_map[idx/8] |= 1 << (idx%8);
+        run_map_top = MAX(run_map_top, idx/8 + 1);
+        run_link(r);
     }
-    else if (size<=LIST17){
-        return 16;
+    
+    for (w = 0; r->map[w] == 0; w++)
+        ;
+    idx = w*64 + __builtin_ctzll(r->map[w]);
+    r->map[w] &= r->map[w] - 1;
+    if (--r->nfree == 0)
+        run_unlink(r);
+    return (char *)r + RUN_HDR + idx*ssize;
+}
+
+/*
+ * slab_free - Give a slot back to its run, and the run back to the heap
+ *             once all its slots are free
+ */
+static void slab_free(void *bp)
+{
+    struct run *r = RUN_OF(bp);
+    size_t idx = ((char *)bp - (char *)r - RUN_HDR) / r->size;
+    
+    r->map[idx/64] |= 1ULL << (idx%64);
+    if (r->nfree++ == 0)
+        run_link(r);
+    if (r->nfree == (RUN_SIZE - RUN_HDR) / r->size) {
+        run_unlink(r);
+        idx = RUN_IDX(r);
+        run_map[idx/8] &= ~(1 << (idx%8));
+        free_block(r);
     }
-    else if (size<=LIST18){
-        return 17;
+}
+
+/*
+ * slab_reset - Forget every run; mm_init is about to lay out a new heap
+ */
+static void slab_reset(void)
+{
+    memset(run_map, 0, run_map_top);
+    run_map_top = 0;
+    memset(run_partial, 0, sizeof(run_partial));
+}
+#endif
+
+/*
+ * list_key - map a size to its slot in list_small or list_large.
+ * Small sizes are indexed by doubleword, larger ones by the position of
+ * the leading one bit plus the next LIST_SUB_LOG bits below it.
+ */
+static inline size_t list_key(size_t size){
+    size_t s = size - 1;
+    int msb;
+    
+    if (size <= LIST_SMALL)
+        return s / DSIZE;
+    msb = 8*sizeof(size_t) - 1 - __builtin_clzl(s);
+    return (msb - LIST_SMALL_LOG) * LIST_SUB +
+           ((s >> (msb - LIST_SUB_LOG)) & (LIST_SUB - 1));
+}
+
+/*
+ * list_init - fill the lookup tables with the first free list whose
+ * limit can hold the smallest size mapping to each slot
+ */
+static void list_init(void){
+    size_t key, size;
+    int msb, entry;
+    
+    for (key = 0; key < LIST_SMALL/DSIZE; key++){
+        size = key * DSIZE + 1;
+        for (entry = 0; size > list_limit[entry]; entry++)
+            ;
+        list_small[key] = entry;
     }
-    else if (size<=LIST19){
-        return 18;
+    for (key = 0; key < LIST_LARGE_NUM; key++){
+        msb = key / LIST_SUB + LIST_SMALL_LOG;
+        size = ((size_t)1 << msb) +
+               ((key % LIST_SUB) << (msb - LIST_SUB_LOG)) + 1;
+        for (entry = 0; size > list_limit[entry]; entry++)
+            ;
+        list_large[key] = entry;
     }
-    else return LIST_NUM-1;
+    addr_list = list_entry(ADDR_MIN) + 1;
+#ifdef SIZE_TREE
+    tree_list = list_entry(TREE_MIN) + 1;
+#endif
+    list_ready = 1;
+}
+
+/*
+ * list_entry - serach for list that fits
+ * Block sizes are multiples of DSIZE, so small sizes need no correction.
+ * A large slot spans at most one limit of the table above, so the loop
+ * steps at most once.
+ */
+/* $begin list_entry */
+static inline int list_entry(size_t size){
+    int entry;
+    
+    if (size <= LIST_SMALL)
+        return list_small[list_key(size)];
+    entry = list_large[list_key(size)];
+    while (size > list_limit[entry])
+        entry++;
+    return entry;
 }
 /* $end list_entry */
 
@@ -332,18 +1934,44 @@ static inline int list_entry(size_t size){
 /* $begin freelist_insert */
 static inline void freelist_insert(void *bp){
     size_t size=GET_SIZE(HDRP(bp));
-    unsigned int * list=(unsigned int *)free_listp+list_entry(size);
+    int entry;
+    word_t * list;
+    char *prev, *next;
     
-    if (*(unsigned int *)list == 0) {          /* Freelist is empty */
+    entry=list_entry(size);
+    STAT_ADD(free_blocks[entry], 1);
+    STAT_ADD(free_bytes[entry], size);
+#ifdef SIZE_TREE
+    if (size > TREE_MIN) {
+        tree_insert(bp);
+        return;
+    }
+#endif
+    list=(word_t *)free_listp+entry;
+    
+    if (*(word_t *)list == 0) {          /* Freelist is empty */
         PTR_OFF(list, bp);
         PUT(bp, 0);
-        PUT((unsigned int *)bp + 1, 0);
+        PUT((word_t *)bp + 1, 0);
+        LIST_MAP |= 1u << entry;
+    }
+    
+    else if (fit_policy == MM_ADDR_FIT && entry >= addr_list &&
+             (char *)bp > OFF_PTR(list)) {     /* Address order, after head */
+        prev = OFF_PTR(list);
+        while (GET(prev) != 0 && (next = OFF_PTR(prev)) < (char *)bp)
+            prev = next;
+        PUT(bp, GET(prev));
+        PTR_OFF((word_t *)bp + 1, prev);
+        if (GET(prev) != 0)
+            PTR_OFF((word_t *)OFF_PTR(prev) + 1, bp);
+        PTR_OFF(prev, bp);
     }
     
     else {                                      /* Freelist not empty */
-        PUT(bp, *(unsigned int*)list);
-        PUT((unsigned int *)bp + 1, 0);
-        PTR_OFF((unsigned int *)OFF_PTR(list)+ 1, bp);
+        PUT(bp, *(word_t *)list);
+        PUT((word_t *)bp + 1, 0);
+        PTR_OFF((word_t *)OFF_PTR(list)+ 1, bp);
         PTR_OFF(list, bp);
     }
 }
@@ -354,10 +1982,23 @@ static inline void freelist_insert(void *bp){
 /* $begin freelist_delete */
 static inline void freelist_delete(void *bp){
     size_t size=GET_SIZE(HDRP(bp));
-    unsigned int * list=(unsigned int *)free_listp+list_entry(size);
+    int entry;
+    word_t * list;
+    
+    entry=list_entry(size);
+    STAT_ADD(free_blocks[entry], -1);
+    STAT_ADD(free_bytes[entry], -size);
+#ifdef SIZE_TREE
+    if (size > TREE_MIN) {
+        tree_delete(bp);
+        return;
+    }
+#endif
+    list=(word_t *)free_listp+entry;
     
     if (GET(bp)==0&&GET(bp+WSIZE)==0){         /* Freelist is empty */
         PUT(list, 0);
+        LIST_MAP &= ~(1u << entry);
     }
     
     if (GET(bp)==0&&GET(bp+WSIZE)!=0){         /* Last free block of freelist */
@@ -365,17 +2006,204 @@ static inline void freelist_delete(void *bp){
     }
     
     if (GET(bp)!=0&&GET(bp+WSIZE)==0){         /* First free block of freelist */
-        PUT((unsigned int *)OFF_PTR(bp)+1,0);
+        PUT((word_t *)OFF_PTR(bp)+1,0);
         PUT(list, GET(bp));
     }
     
     if (GET(bp)!=0&&GET(bp+WSIZE)!=0){         /* In the middle of freelist */
-        PUT((unsigned int *)OFF_PTR(bp)+1,GET(bp+WSIZE));
+        PUT((word_t *)OFF_PTR(bp)+1,GET(bp+WSIZE));
         PUT(OFF_PTR(bp+WSIZE),GET(bp));
     }
 }
 /* $end freelist_delete */
 
+#ifdef SIZE_TREE
+/*
+ * tree_less - Order of tree nodes: by size, then by address
+ */
+static inline int tree_less(char *a, char *b)
+{
+    size_t asize = GET_SIZE(HDRP(a)), bsize = GET_SIZE(HDRP(b));
+    
+    return asize < bsize || (asize == bsize && a < b);
+}
+
+/*
+ * tree_replace - Make new take old's place under parent
+ */
+static inline void tree_replace(char *parent, char *old, char *new)
+{
+    word_t *root = (word_t *)free_listp + tree_list;
+    
+    if (parent == NULL)
+        T_SET(root, new);
+    else if (T_GET(T_CHILD(parent, 0)) == old)
+        T_SET(T_CHILD(parent, 0), new);
+    else
+        T_SET(T_CHILD(parent, 1), new);
+}
+
+/*
+ * tree_rotate - Rotate x down towards side d; its child on the other
+ *               side takes its place
+ */
+static void tree_rotate(char *x, int d)
+{
+    char *y = T_GET(T_CHILD(x, !d));
+    char *c = T_GET(T_CHILD(y, d));
+    
+    T_SET(T_CHILD(x, !d), c);
+    if (c)
+        T_SET(T_PARENT(c), x);
+    tree_replace(T_GET(T_PARENT(x)), x, y);
+    *T_PARENT(y) = *T_PARENT(x);
+    T_SET(T_CHILD(y, d), x);
+    T_SET(T_PARENT(x), y);
+}
+
+/*
+ * tree_insert - Add a free block to the size tree and rebalance
+ */
+static void tree_insert(void *bp)
+{
+    word_t *root = (word_t *)free_listp + tree_list;
+    char *x = bp, *p = NULL, *g, *u, *cur = T_GET(root);
+    int d = 0, side;
+    
+    while (cur) {                                   /* Find the leaf slot */
+        p = cur;
+        d = !tree_less(x, cur);
+        cur = T_GET(T_CHILD(cur, d));
+    }
+    PUT(T_CHILD(x, 0), 0);
+    PUT(T_CHILD(x, 1), 0);
+    T_SET(T_PARENT(x), p);
+    T_RED(x) = 1;
+    if (p == NULL)
+        T_SET(root, x);
+    else
+        T_SET(T_CHILD(p, d), x);
+    LIST_MAP |= 1u << tree_list;
+    
+    while ((p = T_GET(T_PARENT(x))) && T_RED(p)) {  /* Red parent: fix up */
+        g = T_GET(T_PARENT(p));
+        side = (T_GET(T_CHILD(g, 1)) == p);
+        u = T_GET(T_CHILD(g, !side));
+        if (u && T_RED(u)) {                        /* Red uncle: recolour */
+            T_RED(p) = 0;
+            T_RED(u) = 0;
+            T_RED(g) = 1;
+            x = g;
+            continue;
+        }
+        if (x == T_GET(T_CHILD(p, !side))) {        /* Inner child: straighten */
+            x = p;
+            tree_rotate(x, side);
+            p = T_GET(T_PARENT(x));
+        }
+        T_RED(p) = 0;
+        T_RED(g) = 1;
+        tree_rotate(g, !side);
+    }
+    T_RED(T_GET(root)) = 0;
+}
+
+/*
+ * tree_delete - Remove a free block from the size tree and rebalance
+ */
+static void tree_delete(void *bp)
+{
+    word_t *root = (word_t *)free_listp + tree_list;
+    char *z = bp, *y = bp, *x, *xp, *w, *c;
+    int red, side;
+    
+    if (GET(T_CHILD(z, 0)) && GET(T_CHILD(z, 1))) { /* Unlink the successor */
+        y = T_GET(T_CHILD(z, 1));
+        while (GET(T_CHILD(y, 0)))
+            y = T_GET(T_CHILD(y, 0));
+    }
+    x = T_GET(T_CHILD(y, GET(T_CHILD(y, 0)) == 0));
+    xp = T_GET(T_PARENT(y));
+    if (x)
+        T_SET(T_PARENT(x), xp);
+    tree_replace(xp, y, x);
+    red = T_RED(y);
+    
+    if (y != z) {                                   /* Successor takes z's place */
+        *T_CHILD(y, 0) = *T_CHILD(z, 0);
+        *T_CHILD(y, 1) = *T_CHILD(z, 1);
+        *T_PARENT(y) = *T_PARENT(z);
+        T_RED(y) = T_RED(z);
+        tree_replace(T_GET(T_PARENT(z)), z, y);
+        if ((c = T_GET(T_CHILD(y, 0))))
+            T_SET(T_PARENT(c), y);
+        if ((c = T_GET(T_CHILD(y, 1))))
+            T_SET(T_PARENT(c), y);
+        if (xp == z)
+            xp = y;
+    }
+    
+    if (GET(root) == 0) {
+        LIST_MAP &= ~(1u << tree_list);
+        return;
+    }
+    if (red)
+        return;
+    
+    while (x != T_GET(root) && (x == NULL || !T_RED(x))) { /* Black removed: fix up */
+        side = (T_GET(T_CHILD(xp, 0)) != x);      /* A null x has a sibling */
+        w = T_GET(T_CHILD(xp, !side));
+        if (T_RED(w)) {                             /* Red sibling: rotate it up */
+            T_RED(w) = 0;
+            T_RED(xp) = 1;
+            tree_rotate(xp, side);
+            w = T_GET(T_CHILD(xp, !side));
+        }
+        c = T_GET(T_CHILD(w, !side));
+        if ((c == NULL || !T_RED(c)) &&
+            (T_GET(T_CHILD(w, side)) == NULL || !T_RED(T_GET(T_CHILD(w, side))))) {
+            T_RED(w) = 1;                           /* Black nephews: move up */
+            x = xp;
+            xp = T_GET(T_PARENT(x));
+            continue;
+        }
+        if (c == NULL || !T_RED(c)) {               /* Near nephew red: turn it out */
+            T_RED(T_GET(T_CHILD(w, side))) = 0;
+            T_RED(w) = 1;
+            tree_rotate(w, !side);
+            w = T_GET(T_CHILD(xp, !side));
+        }
+        T_RED(w) = T_RED(xp);
+        T_RED(xp) = 0;
+        T_RED(T_GET(T_CHILD(w, !side))) = 0;
+        tree_rotate(xp, side);
+        x = T_GET(root);
+    }
+    if (x)
+        T_RED(x) = 0;
+}
+
+/*
+ * tree_fit - Smallest free block in the tree of at least asize bytes,
+ *            the lowest addressed one among equals
+ */
+static void *tree_fit(size_t asize)
+{
+    char *bp = T_GET((word_t *)free_listp + tree_list);
+    char *best = NULL;
+    
+    while (bp) {
+        if (GET_SIZE(HDRP(bp)) >= asize) {
+            best = bp;
+            bp = T_GET(T_CHILD(bp, 0));
+        }
+        else
+            bp = T_GET(T_CHILD(bp, 1));
+    }
+    return best;
+}
+#endif
+
 
 /*
  * coalesce - Boundary tag coalescing. Return ptr to coalesced block
@@ -388,11 +2216,13 @@ static void *coalesce(void *bp)
     size_t size = GET_SIZE(HDRP(bp));
     
     if (prev_alloc && next_alloc) {            /* Case 1 */
+        STAT_ADD(coalesces[0], 1);
         freelist_insert(bp);
     }
     
     else if (prev_alloc && !next_alloc) {      /* Case 2 */
-        
+        STAT_ADD(coalesces[1], 1);
+        freelist_delete(NEXT_BLKP(bp));
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
         PUT_HD(HDRP(bp), PACK(size, 0));
         PUT(FTRP(bp), PACK(size,0));
@@ -400,6 +2230,7 @@ static void *coalesce(void *bp)
     }
     
     else if (!prev_alloc && next_alloc) {      /* Case 3 */
+        STAT_ADD(coalesces[2], 1);
         freelist_delete(PREV_BLKP(bp));
         size += GET_SIZE(HDRP(PREV_BLKP(bp)));
         PUT(FTRP(bp), PACK(size, 0));
@@ -409,6 +2240,7 @@ static void *coalesce(void *bp)
     }
     
     else {                                     /* Case 4 */
+        STAT_ADD(coalesces[3], 1);
         freelist_delete(PREV_BLKP(bp));
         freelist_delete(NEXT_BLKP(bp));
         size += GET_SIZE(HDRP(PREV_BLKP(bp))) +
@@ -425,6 +2257,10 @@ static void *coalesce(void *bp)
     
     if ((rover > (char *)bp) && (rover < NEXT_BLKP(bp)))
         rover = bp;
+#endif
+#ifdef CHECK_HEAP
+    if ((check_bp > (char *)bp) && (check_bp < NEXT_BLKP(bp)))
+        check_bp = bp;
 #endif
     /* $begin mmfree */
     return bp;
@@ -432,48 +2268,433 @@ static void *coalesce(void *bp)
 /* $end mmfree */
 
 /*
- * mm_realloc - Naive implementation of realloc
+ * mm_set_policy - Select the placement policy used from the next mm_init,
+ *                 since MM_ADDR_FIT needs its lists in address order from
+ *                 the start. Returns -1 if the policy is unknown; only
+ *                 first fit is available under NEXT_FIT.
+ */
+int mm_set_policy(int policy)
+{
+#ifdef NEXT_FIT
+    if (policy != MM_FIRST_FIT)
+        return -1;
+#endif
+    if (policy < 0 || policy >= MM_POLICY_NUM)
+        return -1;
+#ifdef FIXED_POLICY
+    return (policy == FIT_POLICY) ? 0 : -1;
+#else
+    next_policy = policy;
+    return 0;
+#endif
+}
+
+/*
+ * mm_set_coalesce - Choose eager or deferred coalescing of freed blocks.
+ *                   Returns -1 if the mode is unknown; only eager
+ *                   coalescing is available without DEFER_COALESCE.
+ */
+int mm_set_coalesce(int mode)
+{
+#ifdef DEFER_COALESCE
+    if (mode != MM_EAGER && mode != MM_DEFERRED)
+        return -1;
+#ifdef FIXED_POLICY
+    return (mode == COALESCE_MODE) ? 0 : -1;
+#else
+    coalesce_mode = mode;
+    return 0;
+#endif
+#else
+    return (mode == MM_EAGER) ? 0 : -1;
+#endif
+}
+
+/*
+ * mm_thread_safe - Nonzero when the package may be entered from several
+ *                  threads at once, that is under THREAD_CACHE or ARENAS
+ */
+int mm_thread_safe(void)
+{
+#if defined(THREAD_CACHE) || defined(ARENAS)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * mm_usable_size - Payload bytes of the block at bp, at least the size
+ *                  last requested for it
+ */
+size_t mm_usable_size(void *bp)
+{
+    if (bp == NULL)
+        return 0;
+#ifdef SLAB
+    if (IS_SLAB(bp))
+        return RUN_OF(bp)->size;
+#endif
+#ifdef HUGE_MMAP
+    if (IS_MMAPPED(bp))
+        return MMAP_LEN(bp) - MMAP_HDR;
+#endif
+    return GET_SIZE(HDRP(bp)) - WSIZE;
+}
+
+/*
+ * mm_fork_prepare, mm_fork_release - Take every heap lock before fork()
+ *                  and release them after it, in parent and child alike,
+ *                  so the child cannot inherit a lock held by a thread
+ *                  that does not exist there. arena_lock comes first, as
+ *                  in thread_arena.
+ */
+void mm_fork_prepare(void)
+{
+#ifdef ARENAS
+    pthread_mutex_lock(&arena_lock);
+    for (int i = 0; i < ARENA_NUM; i++)
+        pthread_mutex_lock(&arenas[i].lock);
+#elif defined(THREAD_CACHE)
+    pthread_mutex_lock(&heap_lock);
+#endif
+}
+
+void mm_fork_release(void)
+{
+#ifdef ARENAS
+    for (int i = ARENA_NUM - 1; i >= 0; i--)
+        pthread_mutex_unlock(&arenas[i].lock);
+    pthread_mutex_unlock(&arena_lock);
+#elif defined(THREAD_CACHE)
+    pthread_mutex_unlock(&heap_lock);
+#endif
+}
+
+/*
+ * mm_stats - Copy the counters since mm_init. They are updated without
+ *            locks, so a copy taken while other threads run may be off
+ *            by their operations in flight.
+ */
+int mm_stats(struct mm_stats *st)
+{
+    if (!list_ready)
+        list_init();
+    *st = stats;
+    st->classes = LIST_NUM;
+    for (int i = 0; i < LIST_NUM; i++)
+        st->class_limit[i] = list_limit[i];
+    return 0;
+}
+
+#ifdef SIZE_TREE
+/*
+ * tree_mark - Tag every block of a subtree for heap_dump. Returns the
+ *             number of blocks too small to belong to the tree.
+ */
+static int tree_mark(char *bp)
+{
+    int bad = 0;
+    
+    for (; bp != NULL; bp = T_GET(T_CHILD(bp, 1))) {
+        GET(HDRP(bp)) |= 0x4;
+        bad += GET_SIZE(HDRP(bp)) <= TREE_MIN;
+        bad += tree_mark(T_GET(T_CHILD(bp, 0)));
+    }
+    return bad;
+}
+#endif
+
+/*
+ * heap_dump - Write one record per block of the current heap. Members of
+ *             the free lists are tagged with the third header bit first,
+ *             so each record tells whether its block is listed; the tags
+ *             are cleared on the way. Returns the number of blocks that
+ *             are free but unlisted, listed but allocated, or listed in
+ *             the wrong class.
+ */
+static int heap_dump(FILE *fp, int heap)
+{
+    char *bp;
+    size_t size;
+    int alloc, listed, bad = 0;
+    
+    for (int i = 0; i < LIST_NUM; i++) {
+#ifdef SIZE_TREE
+        if (i == tree_list) {
+            bad += tree_mark(T_GET((word_t *)free_listp + i));
+            continue;
+        }
+#endif
+        for (word_t off = GET(free_listp + i*WSIZE); off != 0; off = GET(bp)) {
+            bp = heap_listp + off;
+            if (GET(HDRP(bp)) & 0x4) {
+                bad++;                              /* Cycle or shared block */
+                break;
+            }
+            GET(HDRP(bp)) |= 0x4;
+            bad += list_entry(GET_SIZE(HDRP(bp))) != i;
+        }
+    }
+    
+    for (bp = NEXT_BLKP(heap_listp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+        size = GET_SIZE(HDRP(bp));
+        alloc = GET_ALLOC(HDRP(bp));
+        listed = (GET(HDRP(bp)) & 0x4) != 0;
+        GET(HDRP(bp)) &= ~0x4;
+        bad += alloc == listed;
+        fprintf(fp, "%d,%ld,%zu,%d,%d,%d\n", heap, (long)(bp - heap_listp),
+                size, alloc, list_entry(size), listed);
+    }
+    return bad;
+}
+
+/*
+ * mm_dump - Write a CSV snapshot of every heap: heap, offset of the block
+ *           from the prologue, size, allocated bit, size class and
+ *           whether the block sits on a free list. Blocks held by a
+ *           thread cache or quick list count as allocated. Returns the
+ *           number of inconsistent blocks, as heap_dump.
+ */
+int mm_dump(FILE *fp)
+{
+    int bad = 0;
+    
+    fprintf(fp, "heap,offset,size,alloc,class,listed\n");
+#ifdef ARENAS
+    for (int i = 0; i < ARENA_NUM; i++) {
+        if (arenas[i].heap_listp == 0)
+            continue;
+        arena_enter(&arenas[i]);
+        bad += heap_dump(fp, i);
+        arena_leave();
+    }
+#else
+    if (heap_listp == 0)
+        return 0;
+    LOCK();
+    bad = heap_dump(fp, 0);
+    UNLOCK();
+#endif
+    return bad;
+}
+
+/*
+ * mm_realloc - Resize a block in place when its neighbourhood allows,
+ *              falling back to malloc, copy and free
  */
 void *mm_realloc(void *ptr, size_t size)
 {
-    {
-        size_t oldsize;
-        void *newptr;
-        
-        /* If size == 0 then this is just free, and we return NULL. */
-        if(size == 0) {
-            mm_free(ptr);
-            return 0;
+    size_t asize;
+    size_t oldsize;
+    void *newptr;
+    
+    /* If size == 0 then this is just free, and we return NULL. */
+    if(size == 0) {
+        mm_free(ptr);
+        return 0;
+    }
+    
+    /* If oldptr is NULL, then this is just malloc. */
+    if(ptr == NULL) {
+        return mm_malloc(size);
+    }
+    
+#ifdef SLAB
+    if (IS_SLAB(ptr)) {
+        oldsize = RUN_OF(ptr)->size;
+        if (size <= oldsize && size > oldsize - SLAB_STEP) {
+            STAT_ADD(realloc_inplace, 1);
+            return ptr;                                     /* Same slot size */
         }
-        
-        /* If oldptr is NULL, then this is just malloc. */
-        if(ptr == NULL) {
-            return mm_malloc(size);
+    }
+    else
+#endif
+#ifdef HUGE_MMAP
+    if (IS_MMAPPED(ptr))
+        return mmap_realloc(ptr, size);
+    else if (size < MMAP_THRESHOLD)
+#else
+    if (size <= MAX_REQUEST)
+#endif
+    {
+        CHECK_HEADER(ptr);
+        asize = ADJUST_SIZE(size);
+        LOCK_FOR(ptr);
+        newptr = realloc_block(ptr, asize);
+        UNLOCK();
+        if (newptr) {
+            STAT_ADD(realloc_inplace, 1);
+            return newptr;
         }
-        
+    }
+    
+    /* A block that had to move for growth tends to grow again */
+#ifdef SLAB
+    oldsize = IS_SLAB(ptr) ? RUN_OF(ptr)->size : GET_SIZE(HDRP(ptr)) - WSIZE;
+#else
+    oldsize = GET_SIZE(HDRP(ptr)) - WSIZE;
+#endif
+    newptr = NULL;
+    if (size > oldsize && size + REALLOC_RESERVE(size) > size)
+        newptr = mm_malloc(size + REALLOC_RESERVE(size));
+    if (!newptr)
         newptr = mm_malloc(size);
+    
+    /* If realloc() fails the original block is left untouched  */
+    if(!newptr) {
+        return 0;
+    }
+    
+    /* Copy the old payload. */
+    STAT_ADD(realloc_copy, 1);
+    memcpy(newptr, ptr, MIN(size, oldsize));
+    
+    /* Free the old block. */
+    mm_free(ptr);
+    
+    return newptr;
+}
+
+/*
+ * realloc_block - Resize block bp to asize bytes without moving it.
+ *                 A shrink splits off the tail; a growth absorbs the
+ *                 free successor, extending the heap first when bp or
+ *                 that successor is the last block. Returns NULL when
+ *                 the block has to move.
+ */
+static void *realloc_block(void *bp, size_t asize)
+{
+    size_t csize = GET_SIZE(HDRP(bp));
+    size_t nsize;
+    char *next;
+    
+    if (asize > csize) {
+        next = NEXT_BLKP(bp);
+        nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
         
-        /* If realloc() fails the original block is left untouched  */
-        if(!newptr) {
-            return 0;
+        /* Last block before the epilogue: grow the heap by the shortfall */
+        if (csize + nsize < asize &&
+            GET_SIZE(HDRP(nsize ? NEXT_BLKP(next) : next)) == 0) {
+            if (extend_heap(MAX(asize - csize - nsize, 2*DSIZE)/WSIZE) == NULL)
+                return NULL;
+            nsize = GET_SIZE(HDRP(next));
         }
+        if (csize + nsize < asize)
+            return NULL;
         
-        /* Copy the old data. */
-        oldsize = GET_SIZE(HDRP(ptr));
-        if(size < oldsize) oldsize = size;
-        memcpy(newptr, ptr, oldsize);
-        
-        /* Free the old block. */
-        mm_free(ptr);
-        
-        return newptr;
+        freelist_delete(next);
+#ifdef NEXT_FIT
+        if (rover == next)
+            rover = bp;
+#endif
+#ifdef CHECK_HEAP
+        if (check_bp == next)
+            check_bp = bp;
+#endif
+        csize += nsize;
+        PUT_HD(HDRP(bp), PACK(csize, 1));
+        PREV_ALLOC(bp);
+    }
+    
+    /* Give back the tail if it can stand as a free block */
+    if (csize - asize >= 2*DSIZE) {
+        STAT_ADD(splits, 1);
+        PUT_HD(HDRP(bp), PACK(asize, 1));
+        next = NEXT_BLKP(bp);
+        PUT(HDRP(next), PACK(csize-asize, 1) | 0x2);
+        free_block(next);
     }
+    return bp;
 }
 
 /*
  * The remaining routines are internal helper routines
  */
 
+#ifdef HUGE_MMAP
+/*
+ * mmap_block - Give a huge request its own mapping. The payload starts
+ *              MMAP_HDR bytes in, after the mapping length and a header
+ *              carrying the huge block tag.
+ */
+static void *mmap_block(size_t size)
+{
+    size_t page = mem_pagesize();
+    size_t len;
+    char *p;
+    
+    if (size > (size_t)-1 - MMAP_HDR - page)
+        return NULL;
+    len = (size + MMAP_HDR + page - 1) & ~(page - 1);
+    if ((p = mem_map(len, page)) == NULL)
+        return NULL;
+    p += MMAP_HDR;
+    MMAP_LEN(p) = len;
+    PUT(HDRP(p), PACK(0, 0x5));
+    return p;
+}
+
+/*
+ * mmap_realloc - Resize a huge block. It stays mapped while the new size
+ *                is huge, grown or shrunk by mem_remap without copying,
+ *                and moves into the heap otherwise.
+ */
+static void *mmap_realloc(void *ptr, size_t size)
+{
+    size_t page = mem_pagesize();
+    size_t len = MMAP_LEN(ptr);
+    size_t newlen;
+    char *p;
+    
+    if (size >= MMAP_THRESHOLD && size <= (size_t)-1 - MMAP_HDR - page) {
+        newlen = (size + MMAP_HDR + page - 1) & ~(page - 1);
+        if (newlen == len) {
+            STAT_ADD(realloc_inplace, 1);
+            return ptr;
+        }
+        if ((p = mem_remap((char *)ptr - MMAP_HDR, len, newlen)) != NULL) {
+            STAT_ADD(realloc_inplace, 1);                   /* Pages move, bytes are not copied */
+            p += MMAP_HDR;
+            MMAP_LEN(p) = newlen;
+            return p;
+        }
+    }
+    
+    if ((p = mm_malloc(size)) == NULL)
+        return NULL;
+    STAT_ADD(realloc_copy, 1);
+    memcpy(p, ptr, MIN(size, len - MMAP_HDR));
+    mm_free(ptr);
+    return p;
+}
+#endif
+
+/*
+ * grow_size - Bytes to extend the heap by for a block of asize that no
+ *             free block fits. A free last block only needs the shortfall;
+ *             otherwise the extension doubles while misses come close
+ *             together and drops back to CHUNKSIZE when they are rare.
+ */
+static size_t grow_size(size_t asize)
+{
+    char *top = heap_top();
+    size_t last, cap;
+    
+    if (!GET_PREV_ALLOC(top)) {                 /* Last block is free */
+        last = GET_SIZE(top - DSIZE);
+        return (asize > last + 2*DSIZE) ? asize - last : 2*DSIZE;
+    }
+    
+    cap = MIN(GROW_MAX, (size_t)(top - heap_listp) / GROW_FRAC);
+    if (grow_ops < GROW_WINDOW)
+        grow_chunk = MIN(2*grow_chunk, MAX(cap, CHUNKSIZE));
+    else
+        grow_chunk = CHUNKSIZE;
+    grow_ops = 0;
+    return MAX(asize, grow_chunk);
+}
+
 /*
  * extend_heap - Extend heap with free block and return its block pointer
  */
@@ -485,13 +2706,17 @@ static void *extend_heap(size_t words)
     
     /* Allocate an even number of words to maintain alignment */
     size = (words % 2) ? (words+1) * WSIZE : words * WSIZE; //line:vm:mm:beginextend
-    if ((long)(bp = mem_sbrk(size)) == -1)
+    if ((size_t)(heap_top() - heap_listp) + size > HEAP_SPAN)
+        return NULL;                                        /* Offsets would overflow */
+    if ((long)(bp = heap_sbrk(size)) == -1)
         return NULL;                                        //line:vm:mm:endextend
+    STAT_ADD(extends, 1);
+    STAT_ADD(extend_bytes, size);
     
     /* Initialize free block header/footer and the epilogue header */
     PUT_HD(HDRP(bp), PACK(size, 0));         /* Free block header */   //line:vm:mm:freeblockhdr
     PUT(FTRP(bp), PACK(size, 0));         /* Free block footer */   //line:vm:mm:freeblockftr
-    PUT_HD(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */ //line:vm:mm:newepihdr
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));    /* New epilogue header, prev free */ //line:vm:mm:newepihdr
     
     /* Coalesce if the previous block was free */
     return coalesce(bp);                                          //line:vm:mm:returnblock
@@ -510,6 +2735,7 @@ static void place(void *bp, size_t asize)
     size_t csize = GET_SIZE(HDRP(bp));
     freelist_delete(bp);
     if ((csize - asize) >= (2*DSIZE)) {
+        STAT_ADD(splits, 1);
         PUT_HD(HDRP(bp), PACK(asize, 1));
 //        PUT(FTRP(bp), PACK(asize, 1));
         PREV_ALLOC(bp);
@@ -529,24 +2755,39 @@ static void place(void *bp, size_t asize)
 
 
 /* 
- * find_block - search list for a block
+ * find_block - search list for a block. First fit takes the first block
+ *              that is large enough, exact fit goes on looking for one of
+ *              exactly asize bytes, best fit keeps the tightest of the
+ *              first BEST_FIT_K that fit.
  */
 /* $begin find_block */
 static void *find_block(void *list,size_t asize){
     char* bp=OFF_PTR(list);
+    char *best=NULL;
+    size_t size, best_size=0;
+    int k=0;
     if (GET(list)==0){
         return NULL;
     }
     while(bp)
     {
-        if(GET_SIZE(HDRP(bp))>=asize)
-            return (void*)bp;
+        size=GET_SIZE(HDRP(bp));
+        if(size>=asize){
+            if (fit_policy==MM_FIRST_FIT || fit_policy==MM_ADDR_FIT || size==asize)
+                return (void*)bp;
+            if (best==NULL || (fit_policy==MM_BEST_FIT && size<best_size)){
+                best=bp;
+                best_size=size;
+            }
+            if (fit_policy==MM_BEST_FIT && ++k==BEST_FIT_K)
+                return best;
+        }
         if (GET(bp)==0){
-            return NULL;
+            return best;
         }
-        bp=OFF_PTR((unsigned int *)bp);
+        bp=OFF_PTR((word_t *)bp);
     }
-    return NULL;
+    return best;
 }
 /* $end find_block */
 
@@ -579,93 +2820,326 @@ static void *find_fit(size_t asize)
     /* $begin mmfirstfit */
     /* First fit search */
     
-    int entry=list_entry(asize);
+    int first=list_entry(asize);
+    unsigned int map;
+    int entry;
     char *bp;
-    while(entry<LIST_NUM){
-        if (GET(free_listp+WSIZE*entry)==0){        /* fail to find in current list, find next */
-            entry++;
-            continue;
-        }
-        else{
-            bp=(char*)find_block(free_listp+entry*WSIZE,asize);
-            entry++;
+#ifdef SIZE_TREE
+    if (first>tree_list)                        /* Lists above the tree are unused */
+        first=tree_list;
+#endif
+    map=LIST_MAP & (~0u << first);              /* Non-empty lists that may fit */
+    while(map){
+        entry=__builtin_ctz(map);
+#ifdef SIZE_TREE
+        if (entry==tree_list)                   /* Holds every larger block */
+            return tree_fit(asize);
+#endif
+        if (entry>first && fit_policy!=MM_BEST_FIT){ /* Any block of a larger list fits */
+            return OFF_PTR(free_listp+entry*WSIZE);
         }
+        bp=(char*)find_block(free_listp+entry*WSIZE,asize);
         if(bp) {
             return bp;
         }
+        map&=map-1;                                 /* Fail to find in current list, find next */
     }
     return NULL; /* No fit */
     /* $end mmfirstfit */
 #endif
 }
 
+/*
+ * printblock - Print the header of bp, and the footer of a free block;
+ *              allocated blocks have none
+ */
 static void printblock(void *bp)
 {
-    size_t hsize, halloc, fsize, falloc;
-    
-    mm_checkheap(0);
-    hsize = GET_SIZE(HDRP(bp));
-    halloc = GET_ALLOC(HDRP(bp));
-    fsize = GET_SIZE(FTRP(bp));
-    falloc = GET_ALLOC(FTRP(bp));
+    size_t hsize = GET_SIZE(HDRP(bp));
+    int halloc = GET_ALLOC(HDRP(bp));
+    int palloc = GET_PREV_ALLOC(bp) != 0;
     
     if (hsize == 0) {
         printf("%p: EOL\n", bp);
         return;
     }
+    if (halloc)
+        printf("%p: header: [%ld:a] prev: %c\n", bp, (long)hsize,
+               palloc ? 'a' : 'f');
+    else
+        printf("%p: header: [%ld:f] prev: %c footer: [%ld:%c]\n", bp,
+               (long)hsize, palloc ? 'a' : 'f', (long)GET_SIZE(FTRP(bp)),
+               GET_ALLOC(FTRP(bp)) ? 'a' : 'f');
+}
+
+/*
+ * check_block - Check block bp against its neighbours in address order:
+ *               a free block has a matching footer, is followed by an
+ *               allocated block and clears its prev-alloc bit; an
+ *               allocated block whose prev-alloc bit is clear follows
+ *               a free block that ends at it
+ */
+static const char *check_block(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    char *next, *prev;
+    
+    if ((size_t)bp % DSIZE != 0)
+        return "block is not doubleword aligned";
+    if (size % DSIZE != 0 || size < 2*DSIZE ||
+        size > (size_t)(heap_top() - (char *)bp))
+        return "header size is corrupt";
+    next = NEXT_BLKP(bp);
+    if (!GET_ALLOC(HDRP(bp))) {
+        if (GET_SIZE(FTRP(bp)) != size || GET_ALLOC(FTRP(bp)))
+            return "footer does not match header";
+        if (!GET_ALLOC(HDRP(next)))
+            return "free blocks not coalesced";
+        if (GET_PREV_ALLOC(next))
+            return "next block's prev-alloc bit is set";
+    } else if (!GET_PREV_ALLOC(bp)) {
+        prev = PREV_BLKP(bp);
+        if (prev <= heap_listp || GET_ALLOC(HDRP(prev)) || NEXT_BLKP(prev) != bp)
+            return "prev-alloc bit is clear but no free block precedes";
+    }
+    return NULL;
+}
+
+/*
+ * check_list - Walk up to max blocks of free list entry: each must be a
+ *              free heap block of the list's size class whose back link
+ *              names its predecessor, and LIST_MAP must show whether the
+ *              list is empty. Returns what is wrong, with the block in
+ *              *at, or NULL.
+ */
+static const char *check_list(int entry, size_t max, char **at)
+{
+    word_t off = GET((word_t *)free_listp + entry);
+    char *bp, *prev = NULL;
+    
+    *at = NULL;
+#ifdef SIZE_TREE
+    if (entry == tree_list)
+        return NULL;                        /* Holds the tree root */
+#endif
+    if ((off != 0) != ((LIST_MAP >> entry) & 1))
+        return "LIST_MAP bit does not match the list";
+    for (; off != 0 && max > 0; off = GET(bp), max--) {
+        *at = bp = heap_listp + off;
+        if (bp <= heap_listp || bp >= heap_top() || (size_t)bp % DSIZE != 0)
+            return "free list link leaves the heap";
+        if (GET_ALLOC(HDRP(bp)))
+            return "allocated block on a free list";
+        if (list_entry(GET_SIZE(HDRP(bp))) != entry)
+            return "block on the wrong free list";
+        if (GET((word_t *)bp + 1) != (prev ? (word_t)(prev - heap_listp) : 0))
+            return "free list back link is broken";
+        prev = bp;
+    }
+    return NULL;
+}
+
+#ifdef CHECK_HEAP
+/*
+ * check_header - O(1) check of a heap block about to be freed or
+ *                resized: it must lie in the heap and be allocated.
+ *                Returns what is wrong, or NULL.
+ */
+static const char *check_header(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    
+    if ((char *)bp <= heap_listp || (char *)bp >= heap_top() ||
+        (size_t)bp % DSIZE != 0)
+        return "not a heap block";
+    if (!GET_ALLOC(HDRP(bp)))
+        return "block is already free";
+    if (size % DSIZE != 0 || size < 2*DSIZE ||
+        size > (size_t)(heap_top() - (char *)bp))
+        return "header size is corrupt";
+    return NULL;
+}
+
+/*
+ * check_next - O(1) check, under the heap lock, that the header after
+ *              allocated block bp is intact: a payload overrun usually
+ *              breaks it first
+ */
+static const char *check_next(void *bp)
+{
+    char *next = NEXT_BLKP(bp);
+    size_t nsize = GET_SIZE(HDRP(next));
     
-    printf("%p: header: [%ld:%c] footer: [%ld:%c]\n", bp,
-           (long)hsize, (char)(halloc ? 'a' : 'f'),
-           (long)fsize, (char)(falloc ? 'a' : 'f'));
+    if (!GET_PREV_ALLOC(next))
+        return "next header says this block is free";
+    if (nsize == 0 ? next != heap_top() :
+        nsize % DSIZE != 0 || nsize > (size_t)(heap_top() - next))
+        return "next header is corrupt";
+    return NULL;
 }
 
-static void checkblock(void *bp)
+/*
+ * check_op - Report a failed check of block bp and abort
+ */
+static void check_op(void *bp, const char *err)
 {
-    if ((size_t)bp % 8)
-        printf("Error: %p is not doubleword aligned\n", bp);                    // Check block alignment
-    if (GET(HDRP(bp)) != GET(FTRP(bp)))
-        printf("Error: header does not match footer\n");                        // Check header/footer match
-    if (GET_ALLOC(HDRP(bp))&&GET_ALLOC(HDRP(NEXT_BLKP(bp))))
-        printf("Error: %p and %p is not coaleasced correctly\n",bp,NEXT_BLKP(bp));// Check no consecutive free blocks
-    if (GET_SIZE(bp)<DSIZE*2)
-        printf("Error: %p does not meet the minumum block size\n",bp);            // Check minimum size
+    if (err == NULL)
+        return;
+    fprintf(stderr, "mm: heap check failed at %p: %s\n", bp, err);
+    abort();
 }
 
 /*
- * checkheap - Minimal check of the heap for consistency
+ * check_tick - Run the periodic tiers once per heap operation: a sampled
+ *              walk of one free list every CHECK_SAMPLE operations, and
+ *              CHECK_STEP blocks of the heap walk, which wraps at the
+ *              epilogue so that it never rests beyond the heap top
  */
-void mm_checkheap(int verbose)
+static void check_tick(void)
+{
+    const char *err;
+    char *at;
+    
+    if (++check_ops >= CHECK_SAMPLE) {
+        check_ops = 0;
+        err = check_list(check_entry, CHECK_LIST_MAX, &at);
+        check_op(at, err);
+        check_entry = (check_entry + 1) % LIST_NUM;
+    }
+    if (check_bp == NULL)
+        check_bp = NEXT_BLKP(heap_listp);
+    for (int k = 0; k < CHECK_STEP && GET_SIZE(HDRP(check_bp)) > 0; k++) {
+        check_op(check_bp, check_block(check_bp));
+        check_bp = NEXT_BLKP(check_bp);
+        if (GET_SIZE(HDRP(check_bp)) == 0) {
+            check_op(check_bp, check_bp != heap_top()
+                     ? "zero size header inside the heap"
+                     : !GET_ALLOC(HDRP(check_bp)) ? "bad epilogue header" : NULL);
+            check_bp = NEXT_BLKP(heap_listp);
+        }
+    }
+}
+#endif
+
+/*
+ * heap_check - Check every block and free list of the current heap,
+ *              printing what is wrong; returns the number of errors
+ */
+static int heap_check(int verbose)
 {
-    char *bp = heap_listp;
+    const char *err;
+    char *bp, *at;
+    int bad = 0;
     
     if (verbose)
         printf("Heap (%p):\n", heap_listp);
     
     if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp))) // Check prologue blocks
-        printf("Bad prologue header\n");
-    if ((GET_SIZE(FTRP(heap_listp)) != DSIZE) || !GET_ALLOC(FTRP(heap_listp)))
-        printf("Bad prologue footer\n");
-    checkblock(heap_listp);                                                    // Check alignment of epilogue blocks
+        printf("Bad prologue header\n"), bad++;
     
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+    for (bp = NEXT_BLKP(heap_listp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
         if (verbose)
             printblock(bp);
-        checkblock(bp);                                                        // Check alignemnt of other blocks
+        if ((err = check_block(bp)) != NULL) {
+            printf("Error: %p: %s\n", bp, err);
+            bad++;
+            if (GET_SIZE(HDRP(bp)) < 2*DSIZE || (char *)NEXT_BLKP(bp) > heap_top())
+                break;                          /* Cannot step past it */
+        }
     }
     
     if (verbose)
         printblock(bp);
-    if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))                   // Check epilogue block
-        printf("Bad epilogue header\n");
+    if (bp != heap_top() || !(GET_ALLOC(HDRP(bp))))                          // Check epilogue block
+        printf("Bad epilogue header\n"), bad++;
+    
+    for (int i = 0; i < LIST_NUM; i++)
+        if ((err = check_list(i, (size_t)-1, &at)) != NULL) {
+            printf("Error: %p: %s\n", at, err);
+            bad++;
+        }
+    return bad;
+}
+
+/*
+ * mm_checkheap - Full check of the heap for consistency, for mdriver -D
+ *                and debugging; see CHECK_HEAP for checks cheap enough
+ *                to leave on
+ */
+void mm_checkheap(int verbose)
+{
+#ifdef ARENAS
+    for (int i = 0; i < ARENA_NUM; i++) {
+        if (arenas[i].heap_listp == 0)
+            continue;
+        arena_enter(&arenas[i]);
+        heap_check(verbose);
+        arena_leave();
+    }
+#else
+    if (heap_listp == 0)
+        return;
+    LOCK();
+    heap_check(verbose);
+    UNLOCK();
+#endif
 }
 
+/*
+ * calloc - Allocate a zeroed array of nmemb elements of size bytes, or
+ *          NULL if the product overflows. Huge blocks are fresh mappings
+ *          and need no clearing. A heap block is only cleared up to the
+ *          old top of the heap, or the clean mark if that is higher:
+ *          beyond it lies a fresh extension, where the allocator has
+ *          written nothing but the old top block's tail words, kept
+ *          within 2*DSIZE of the mark, and perhaps a free block footer
+ *          in the last payload word.
+ */
 void *calloc (size_t nmemb, size_t size)
 {
-    size_t bytes = nmemb * size;
-    void *newptr;
+    size_t bytes, asize;
+    char *bp, *fresh = NULL, *end;
     
-    newptr = malloc(bytes);
-    memset(newptr, 0, bytes);
+    if (nmemb != 0 && size > (size_t)-1 / nmemb)
+        return NULL;
+    bytes = nmemb * size;
     
-    return newptr;
+#ifdef HUGE_MMAP
+    if (bytes >= MMAP_THRESHOLD)
+        return malloc(bytes);                               /* Zero from mem_map */
+#endif
+    asize = ADJUST_SIZE(bytes);
+#ifdef SLAB
+    if (bytes <= SLAB_MAX)
+        asize = 0;
+#endif
+#ifdef THREAD_CACHE
+    if (asize <= TC_MAX)
+        asize = 0;
+#endif
+    if (bytes == 0 || bytes > MAX_REQUEST || asize == 0) {  /* Recycled blocks */
+        if ((bp = malloc(bytes)) != NULL)
+            memset(bp, 0, bytes);
+        return bp;
+    }
+    
+    STAT_ADD(mallocs[list_entry(asize)], 1);
+    LOCK();
+    if (heap_listp != 0)
+        fresh = MAX(heap_top(), heap_clean()) + 2*DSIZE;
+    bp = malloc_block(asize);
+    UNLOCK();
+    if (bp == NULL)
+        return NULL;
+    
+    end = bp + GET_SIZE(HDRP(bp)) - DSIZE;
+    if (fresh == NULL || bp + bytes <= fresh) {
+        memset(bp, 0, bytes);
+    } else {
+        if (fresh > bp)
+            memset(bp, 0, fresh - bp);
+        if (bp + bytes > end)
+            memset(end, 0, bp + bytes - end);
+    }
+    return bp;
 }